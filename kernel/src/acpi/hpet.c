@@ -4,7 +4,7 @@
 #include "acpi/hpet.h"
 #include "arch/x86_64/asm.h"
 #include "klog/klog.h"
-#include "memory/vmm/vmm.h"
+#include "memory/vmalloc/vmalloc.h"
 
 struct __attribute__((packed)) hpet_table_t {
     struct sdt_hdr_t hdr;
@@ -44,8 +44,8 @@ static bool hpet_is_64_bit;
 struct hpet_table_t *hpet_table;
 
 void hpet_init(void) {
-    vmm_map_hhdm(hpet_table->address);
-    hpet = (struct hpet_t *) (hpet_table->address + vmm_get_hhdm_offset());
+    // the registers of up to 32 comparators take 1KiB
+    hpet = ioremap_uc(hpet_table->address, 1024);
 
     uint64_t hpet_comparators_count = ((hpet->general_capabilities >> 8) & 0x1f) + 1;
     uint64_t hpet_period = hpet->general_capabilities >> 32;
@@ -0,0 +1,50 @@
+#include <stddef.h>
+
+#include "acpi/acpi.h"
+#include "acpi/slit.h"
+#include "acpi/srat.h"
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+
+struct __attribute__((packed)) slit_t {
+    struct sdt_hdr_t hdr;
+    uint64_t locality_count;
+    uint8_t distances[];
+};
+
+static struct slit_t *slit;
+
+uint8_t slit_get_distance(uint32_t from_node, uint32_t to_node) {
+    if (from_node == to_node) {
+        return SLIT_LOCAL_DISTANCE;
+    }
+
+    // the SLIT is indexed by proximity domain
+    uint64_t from_domain = srat_get_node_domain(from_node);
+    uint64_t to_domain = srat_get_node_domain(to_node);
+    if (slit == NULL || from_domain >= slit->locality_count || to_domain >= slit->locality_count) {
+        return SLIT_REMOTE_DISTANCE;
+    }
+
+    return slit->distances[from_domain * slit->locality_count + to_domain];
+}
+
+void slit_init(void) {
+    slit = (struct slit_t *) acpi_find_table("SLIT");
+    if (slit == NULL) {
+        klog_info("No SLIT, assuming equal distances between NUMA nodes");
+        return;
+    }
+
+    kassert(acpi_calc_table_checksum(slit) == 0);
+
+    uint32_t node_count = srat_get_node_count();
+    for (uint32_t from = 0; from < node_count; from++) {
+        for (uint32_t to = 0; to < node_count; to++) {
+            klog_debug("SLIT: distance node %llu -> node %llu: %llu",
+                    (uint64_t) from, (uint64_t) to, (uint64_t) slit_get_distance(from, to));
+        }
+    }
+
+    klog_info("SLIT initialized");
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+// distance of a node to itself, the distances of other nodes are relative to it
+#define SLIT_LOCAL_DISTANCE 10
+// distance used for all remote nodes when there is no SLIT
+#define SLIT_REMOTE_DISTANCE 20
+
+uint8_t slit_get_distance(uint32_t from_node, uint32_t to_node);
+void slit_init(void);
@@ -0,0 +1,187 @@
+#include <stddef.h>
+
+#include "acpi/acpi.h"
+#include "acpi/srat.h"
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+#include "memory/kmalloc/kmalloc.h"
+
+struct __attribute__((packed)) srat_entry_t {
+    uint8_t type;
+    uint8_t length;
+    uint8_t start[];
+};
+
+struct __attribute__((packed)) srat_t {
+    struct sdt_hdr_t hdr;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    uint8_t entries[];
+};
+
+struct __attribute__((packed)) srat_lapic_affinity_t {
+    uint8_t proximity_domain_low;
+    uint8_t lapic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+};
+
+struct __attribute__((packed)) srat_mem_affinity_t {
+    uint32_t proximity_domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+};
+
+struct __attribute__((packed)) srat_x2apic_affinity_t {
+    uint16_t reserved0;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+};
+
+// the same bit in the flags of all affinity structures
+static const uint32_t SRAT_FLAG_ENABLED = 1 << 0;
+
+struct cpu_affinity_t {
+    uint32_t lapic_id;
+    uint32_t node;
+};
+
+static struct cpu_affinity_t *cpu_affinities;
+static uint16_t cpu_affinity_count;
+
+static struct srat_mem_range_t *mem_ranges;
+static uint16_t mem_range_count;
+
+static uint32_t node_domains[NUMA_MAX_NODES];
+static uint32_t node_count;
+
+static uint32_t domain_to_node(uint32_t domain) {
+    for (uint32_t node = 0; node < node_count; node++) {
+        if (node_domains[node] == domain) {
+            return node;
+        }
+    }
+
+    if (node_count == NUMA_MAX_NODES) {
+        klog_warn("SRAT: Too many proximity domains, treating domain %llu as part of node 0", domain);
+        return 0;
+    }
+
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+uint32_t srat_get_cpu_node(uint32_t lapic_id) {
+    for (uint16_t i = 0; i < cpu_affinity_count; i++) {
+        if (cpu_affinities[i].lapic_id == lapic_id) {
+            return cpu_affinities[i].node;
+        }
+    }
+
+    return 0;
+}
+
+struct srat_mem_range_t *srat_get_mem_ranges(void) {
+    return mem_ranges;
+}
+
+uint16_t srat_get_mem_range_count(void) {
+    return mem_range_count;
+}
+
+uint32_t srat_get_node_count(void) {
+    // without an SRAT, all memory and CPUs are in a single node
+    return node_count == 0 ? 1 : node_count;
+}
+
+uint32_t srat_get_node_domain(uint32_t node) {
+    kassert(node < srat_get_node_count());
+    return node_domains[node];
+}
+
+void srat_init(void) {
+    struct srat_t *srat = (struct srat_t *) acpi_find_table("SRAT");
+    if (srat == NULL) {
+        klog_info("No SRAT, assuming a single NUMA node");
+        return;
+    }
+
+    kassert(acpi_calc_table_checksum(srat) == 0);
+
+    uint32_t entries_length = srat->hdr.length - offsetof(struct srat_t, entries);
+
+    uint32_t i = 0;
+    while (i < entries_length) {
+        struct srat_entry_t *entry = (struct srat_entry_t *) &srat->entries[i];
+
+        if (entry->type == 0 || entry->type == 2) { // LAPIC / x2APIC affinity
+            cpu_affinity_count++;
+        } else if (entry->type == 1) { // memory affinity
+            mem_range_count++;
+        }
+
+        i += entry->length;
+    }
+
+    cpu_affinities = kmalloc(cpu_affinity_count * sizeof(struct cpu_affinity_t));
+    mem_ranges = kmalloc(mem_range_count * sizeof(struct srat_mem_range_t));
+
+    // disabled entries are dropped, so the counts are recalculated
+    cpu_affinity_count = 0;
+    mem_range_count = 0;
+
+    klog_debug("SRAT entries:");
+
+    i = 0;
+    while (i < entries_length) {
+        struct srat_entry_t *entry = (struct srat_entry_t *) &srat->entries[i];
+
+        if (entry->type == 0) { // LAPIC affinity
+            struct srat_lapic_affinity_t *lapic = (struct srat_lapic_affinity_t *) &entry->start;
+            if (lapic->flags & SRAT_FLAG_ENABLED) {
+                uint32_t domain = lapic->proximity_domain_low
+                    | (uint32_t) lapic->proximity_domain_high[0] << 8
+                    | (uint32_t) lapic->proximity_domain_high[1] << 16
+                    | (uint32_t) lapic->proximity_domain_high[2] << 24;
+                struct cpu_affinity_t *affinity = &cpu_affinities[cpu_affinity_count++];
+                affinity->lapic_id = lapic->lapic_id;
+                affinity->node = domain_to_node(domain);
+                klog_debug("- LAPIC: lapic_id %llu  domain %llu", affinity->lapic_id, domain);
+            }
+
+        } else if (entry->type == 1) { // memory affinity
+            struct srat_mem_affinity_t *mem = (struct srat_mem_affinity_t *) &entry->start;
+            if (mem->flags & SRAT_FLAG_ENABLED && mem->length > 0) {
+                struct srat_mem_range_t *range = &mem_ranges[mem_range_count++];
+                range->base = mem->base;
+                range->length = mem->length;
+                range->node = domain_to_node(mem->proximity_domain);
+                klog_debug("- Memory: %016llx - %016llx  domain %llu",
+                        range->base, range->base + range->length, mem->proximity_domain);
+            }
+
+        } else if (entry->type == 2) { // x2APIC affinity
+            struct srat_x2apic_affinity_t *x2apic = (struct srat_x2apic_affinity_t *) &entry->start;
+            if (x2apic->flags & SRAT_FLAG_ENABLED) {
+                struct cpu_affinity_t *affinity = &cpu_affinities[cpu_affinity_count++];
+                affinity->lapic_id = x2apic->x2apic_id;
+                affinity->node = domain_to_node(x2apic->proximity_domain);
+                klog_debug("- x2APIC: x2apic_id %llu  domain %llu", affinity->lapic_id, x2apic->proximity_domain);
+            }
+        }
+
+        i += entry->length;
+    }
+
+    klog_info("SRAT initialized with %llu NUMA %s", (uint64_t) srat_get_node_count(),
+            srat_get_node_count() == 1 ? "node" : "nodes");
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// proximity domains are numbered densely as NUMA nodes, in order of appearance in the SRAT
+#define NUMA_MAX_NODES 16
+
+struct srat_mem_range_t {
+    uint64_t base;
+    uint64_t length;
+    uint32_t node;
+};
+
+uint32_t srat_get_cpu_node(uint32_t lapic_id);
+struct srat_mem_range_t *srat_get_mem_ranges(void);
+uint16_t srat_get_mem_range_count(void);
+uint32_t srat_get_node_count(void);
+uint32_t srat_get_node_domain(uint32_t node);
+void srat_init(void);
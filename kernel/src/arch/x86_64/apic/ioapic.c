@@ -5,7 +5,9 @@
 #include "arch/x86_64/interrupts/interrupts.h"
 #include "kassert/kassert.h"
 #include "klog/klog.h"
-#include "memory/vmm/vmm.h"
+#include "kpanic/kpanic.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/vmalloc/vmalloc.h"
 #include "mp/mp.h"
 
 static const uint32_t IOREGSEL = 0x0;
@@ -18,14 +20,29 @@ enum ioapic_regs {
     IOREDTBL = 0x10
 };
 
+// registers of every IOAPIC, in the order of madt_get_ioapics
+static volatile uint8_t **ioapic_regs;
+
+static volatile uint8_t *get_regs(uint32_t ioapic_addr) {
+    for (uint16_t i = 0; i < madt_get_ioapic_count(); i++) {
+        if (madt_get_ioapics()[i]->address == ioapic_addr) {
+            return ioapic_regs[i];
+        }
+    }
+
+    kpanic("No IOAPIC at 0x%llx", ioapic_addr);
+}
+
 static uint32_t ioapic_read(uint32_t ioapic_addr, uint8_t reg) {
-    *(volatile uint32_t *) (ioapic_addr + IOREGSEL + vmm_get_hhdm_offset()) = reg;
-    return *(volatile uint32_t *) (ioapic_addr + IOWIN + vmm_get_hhdm_offset());
+    volatile uint8_t *regs = get_regs(ioapic_addr);
+    *(volatile uint32_t *) (regs + IOREGSEL) = reg;
+    return *(volatile uint32_t *) (regs + IOWIN);
 }
 
 static void ioapic_write(uint32_t ioapic_addr, uint8_t reg, uint32_t val) {
-    *(volatile uint32_t *) (ioapic_addr + IOREGSEL + vmm_get_hhdm_offset()) = reg;
-    *(volatile uint32_t *) (ioapic_addr + IOWIN + vmm_get_hhdm_offset()) = val;
+    volatile uint8_t *regs = get_regs(ioapic_addr);
+    *(volatile uint32_t *) (regs + IOREGSEL) = reg;
+    *(volatile uint32_t *) (regs + IOWIN) = val;
 }
 
 uint32_t ioapic_get_max_redir_entry(uint32_t ioapic_addr) {
@@ -41,9 +58,12 @@ void ioapic_write_redtbl(struct ioapic_t *ioapic, uint32_t gsi, uint64_t val) {
 }
 
 void ioapic_init(void) {
+    ioapic_regs = kmalloc(madt_get_ioapic_count() * sizeof(volatile uint8_t *));
+
     for (uint16_t i = 0; i < madt_get_ioapic_count(); i++) {
         struct ioapic_t *ioapic = madt_get_ioapics()[i];
-        vmm_map_hhdm(ioapic->address);
+        // IOWIN is the last register
+        ioapic_regs[i] = ioremap_uc(ioapic->address, IOWIN + sizeof(uint32_t));
 
         uint32_t first_gsi = ioapic->gsi_base;
         uint32_t last_gsi = first_gsi + ioapic_get_max_redir_entry(ioapic->address);
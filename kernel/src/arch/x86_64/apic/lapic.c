@@ -4,7 +4,7 @@
 #include "arch/x86_64/msr.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
-#include "memory/vmm/vmm.h"
+#include "memory/vmalloc/vmalloc.h"
 #include "mp/mp.h"
 #include "timer/timer.h"
 
@@ -72,7 +72,8 @@ enum lapic_icr_shorthand {
 static const uint64_t LAPIC_CALIBRATION_NS = 100000;
 static const uint8_t LAPIC_SPURIOUS_VEC = 0xf0;
 
-static uint64_t lapic_addr;
+// only used in xAPIC mode
+static volatile uint8_t *lapic_regs;
 
 static inline uint16_t reg_to_x2apic_msr(uint16_t reg) {
     return (reg >> 4) + 0x800;
@@ -82,7 +83,7 @@ static inline uint32_t lapic_read(uint16_t reg) {
     if (mp_x2apic_enabled()) {
         return rdmsr(reg_to_x2apic_msr(reg));
     } else {
-        return *(volatile uint32_t *) (lapic_addr + reg + vmm_get_hhdm_offset());
+        return *(volatile uint32_t *) (lapic_regs + reg);
     }
 }
 
@@ -90,7 +91,7 @@ static inline void lapic_write(uint16_t reg, uint32_t val) {
     if (mp_x2apic_enabled()) {
         wrmsr(reg_to_x2apic_msr(reg), val);
     } else {
-        *(volatile uint32_t *) (lapic_addr + reg + vmm_get_hhdm_offset()) = val;
+        *(volatile uint32_t *) (lapic_regs + reg) = val;
     }
 }
 
@@ -104,8 +105,8 @@ static inline uint32_t ns_to_lapic_ticks(uint64_t ns) {
 }
 
 void lapic_init(void) {
-    lapic_addr = rdmsr(MSR_IA32_APIC_BASE) & 0xffffff000;
-    vmm_map_hhdm(lapic_addr);
+    phys_t lapic_addr = rdmsr(MSR_IA32_APIC_BASE) & 0xffffff000;
+    lapic_regs = ioremap_uc(lapic_addr, PAGE_SIZE);
 
     interrupts_set_handler(LAPIC_SPURIOUS_VEC, lapic_spurious_handler);
 }
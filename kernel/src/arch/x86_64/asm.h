@@ -17,10 +17,31 @@ static inline void outb(uint16_t port, uint8_t val) {
     __asm__ volatile("outb %0, %1" : : "a" (val), "Nd" (port));
 }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t eax, edx;
+    __asm__ volatile("rdtsc" : "=a" (eax), "=d" (edx));
+    return ((uint64_t) edx << 32) | eax;
+}
+
+// stores `count` copies of `val` starting at `dest`
+static inline void rep_stosq(void *dest, uint64_t val, uint64_t count) {
+    __asm__ volatile("rep stosq" : "+D" (dest), "+c" (count) : "a" (val) : "memory");
+}
+
 static inline void invlpg(uintptr_t addr) {
     __asm__ volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }
 
+static inline uint64_t rd_cr0(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0) : : "memory");
+    return cr0;
+}
+
+static inline void wr_cr0(uint64_t cr0) {
+    __asm__ volatile("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
 static inline uint64_t rd_cr3(void) {
     uint64_t cr3;
     __asm__ volatile("mov %%cr3, %0" : "=r" (cr3) : : "memory");
@@ -31,6 +52,21 @@ static inline void wr_cr3(uint64_t cr3) {
     __asm__ volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
 }
 
+static inline uint64_t rd_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r" (cr4) : : "memory");
+    return cr4;
+}
+
+static inline void wr_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+// writes back and invalidates all caches, e.g. after changing memory types
+static inline void wbinvd(void) {
+    __asm__ volatile("wbinvd" : : : "memory");
+}
+
 static inline void disable_interrupts(void) {
     __asm__ volatile("cli" : : : "memory");
 }
@@ -50,6 +50,10 @@ void idt_init(void) {
     klog_info("IDT initialized");
 }
 
+void idt_set_ist(uint8_t vector, uint8_t ist) {
+    idt[vector].ist = ist;
+}
+
 void idt_reload(void) {
     __asm__ volatile("lidt %0" : : "m" (idtr) : "memory");
 }
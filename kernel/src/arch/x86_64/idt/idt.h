@@ -1,6 +1,10 @@
 #pragma once
 
+#include <stdint.h>
+
 #define IDT_MAX_DESCRIPTORS 256
 
 void idt_init(void);
 void idt_reload(void);
+// makes the vector switch to stack `ist` of the TSS, 1 to 7, or 0 to stay on the current one
+void idt_set_ist(uint8_t vector, uint8_t ist);
@@ -1,9 +1,12 @@
+#include <stddef.h>
+
 #include "arch/x86_64/idt/idt.h"
 #include "arch/x86_64/interrupts/interrupts.h"
 #include "arch/x86_64/pic/pic.h"
 #include "kassert/kassert.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
+#include "lib/bitmap/bitmap.h"
 #include "lib/spinlock/spinlock.h"
 
 // 0x00 - 0x1f | CPU exceptions
@@ -20,7 +23,10 @@ static const uint8_t ISA_IRQ_OFFSET = 0x30;
 static const uint8_t USABLE_VECTORS_START = 0x40;
 static const uint8_t USABLE_VECTORS_END   = 0xef;
 
-static uint16_t curr_free_vector = USABLE_VECTORS_START;
+// one bit per vector, set if the vector is not available for allocation
+static uint64_t vector_bitmap_words[IDT_MAX_DESCRIPTORS / 64];
+static struct bitmap_t vector_bitmap;
+static struct spinlock_t vector_lock = SPINLOCK_STATIC_INIT;
 
 // interrupt handlers shared across all CPUs
 static int_handler_t int_handlers[IDT_MAX_DESCRIPTORS];
@@ -61,23 +67,38 @@ void interrupts_init(void) {
         int_handlers[pic_irq + PIC2_IRQ_OFFSET] = pic_irq_handler;
     }
 
+    bitmap_init(&vector_bitmap, vector_bitmap_words, NULL, IDT_MAX_DESCRIPTORS);
+    bitmap_set_range(&vector_bitmap, 0, USABLE_VECTORS_START);
+    bitmap_set_range(&vector_bitmap, USABLE_VECTORS_END + 1, IDT_MAX_DESCRIPTORS - USABLE_VECTORS_END - 1);
+
     klog_info("Interrupts initialized");
 }
 
 uint8_t interrupts_alloc_vector(void) {
-    static struct spinlock_t lock = SPINLOCK_STATIC_INIT;
-    spin_lock_irqsave(&lock);
+    spin_lock_irqsave(&vector_lock);
 
-    if (curr_free_vector == USABLE_VECTORS_END) {
+    uint64_t vec = bitmap_find_first_zero(&vector_bitmap);
+    if (vec == BITMAP_NOT_FOUND) {
         kpanic("All usable vectors are exhausted");
     }
 
-    uint8_t ret = curr_free_vector;
-    curr_free_vector++;
+    bitmap_set_bit(&vector_bitmap, vec);
+
+    spin_unlock_irqrestore(&vector_lock);
+
+    return vec;
+}
+
+void interrupts_free_vector(uint8_t vec) {
+    kassert(vec >= USABLE_VECTORS_START && vec <= USABLE_VECTORS_END);
+
+    spin_lock_irqsave(&vector_lock);
 
-    spin_unlock_irqrestore(&lock);
+    kassert(bitmap_get_bit(&vector_bitmap, vec));
+    bitmap_unset_bit(&vector_bitmap, vec);
+    int_handlers[vec] = unknown_int_handler;
 
-    return ret;
+    spin_unlock_irqrestore(&vector_lock);
 }
 
 void interrupts_set_handler(uint8_t vec, int_handler_t handler) {
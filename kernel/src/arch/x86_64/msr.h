@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #define MSR_IA32_APIC_BASE 0x1b
+#define MSR_IA32_PAT 0x277
 #define MSR_GS_BASE 0xc0000101
 #define MSR_KERNEL_GS_BASE 0xc0000102
 
@@ -0,0 +1,85 @@
+#include <stddef.h>
+
+#include "bench/bench.h"
+#include "klog/klog.h"
+#include "mp/mp.h"
+#include "sched/sched.h"
+#include "timer/timer.h"
+
+static struct {
+    void (*worker)(void *arg);
+    void *arg;
+    uint64_t ready;
+    uint64_t done;
+    bool go;
+} smp_run;
+
+static void *smp_thread(void *arg) {
+    (void) arg;
+
+    __atomic_fetch_add(&smp_run.ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&smp_run.go, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    smp_run.worker(smp_run.arg);
+
+    __atomic_fetch_add(&smp_run.done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+uint64_t bench_next_cpu_count(uint64_t cpu_count) {
+    uint64_t max_cpu_count = mp_get_cpu_count();
+    if (cpu_count >= max_cpu_count) {
+        return 0;
+    }
+
+    return cpu_count * 2 > max_cpu_count ? max_cpu_count : cpu_count * 2;
+}
+
+uint64_t bench_run_on_cpus(uint64_t cpu_count, uint64_t threads_per_cpu, void (*worker)(void *arg), void *arg) {
+    uint64_t thread_count = cpu_count * threads_per_cpu;
+
+    smp_run.worker = worker;
+    smp_run.arg = arg;
+    smp_run.ready = 0;
+    smp_run.done = 0;
+    __atomic_store_n(&smp_run.go, false, __ATOMIC_SEQ_CST);
+
+    for (uint64_t i = 0; i < cpu_count; i++) {
+        for (uint64_t j = 0; j < threads_per_cpu; j++) {
+            sched_new_kthread_on(mp_get_cpus()[i], smp_thread, NULL);
+        }
+    }
+
+    // release all threads at once, after every one of them got to run
+    while (__atomic_load_n(&smp_run.ready, __ATOMIC_SEQ_CST) != thread_count) {
+        sched_yield();
+    }
+
+    uint64_t start = timer_get_ns();
+    __atomic_store_n(&smp_run.go, true, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&smp_run.done, __ATOMIC_SEQ_CST) != thread_count) {
+        sched_yield();
+    }
+
+    return timer_get_ns() - start;
+}
+
+void bench_run_all(void) {
+    klog_info("Running benchmarks");
+
+    bench_bitmap();
+    bench_flanterm();
+    bench_kmalloc();
+    bench_kmalloc_smp();
+    bench_pmm();
+    bench_pmm_smp();
+    bench_vmm();
+    bench_vmm_smp();
+    bench_vmm_stress();
+    bench_vmm_cow();
+
+    klog_info("Benchmarks done");
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// boot-time benchmarks, run from the kernel init thread
+// when the kernel is built with -DBENCH (e.g. `make CPPFLAGS=-DBENCH`)
+
+static inline uint64_t bench_per_op(uint64_t total, uint64_t ops) {
+    return ops == 0 ? 0 : total / ops;
+}
+
+static inline uint64_t bench_per_sec(uint64_t ops, uint64_t ns) {
+    return ns == 0 ? 0 : ops * 1000000000 / ns;
+}
+
+// CPU counts to run SMP benchmarks with: 1, 2, 4, ... and finally all CPUs
+// returns 0 after all CPUs were used
+uint64_t bench_next_cpu_count(uint64_t cpu_count);
+
+// runs `worker` in `threads_per_cpu` threads on each of the first `cpu_count` CPUs,
+// releasing them all at once; returns the time until the last one finished, in ns
+uint64_t bench_run_on_cpus(uint64_t cpu_count, uint64_t threads_per_cpu, void (*worker)(void *arg), void *arg);
+
+void bench_run_all(void);
+
+void bench_bitmap(void);
+void bench_flanterm(void);
+void bench_kmalloc(void);
+void bench_kmalloc_smp(void);
+void bench_pmm(void);
+void bench_pmm_smp(void);
+void bench_vmm(void);
+void bench_vmm_cow(void);
+void bench_vmm_smp(void);
+void bench_vmm_stress(void);
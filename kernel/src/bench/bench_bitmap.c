@@ -0,0 +1,122 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "bench/bench.h"
+#include "klog/klog.h"
+#include "lib/bitmap/bitmap.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/vmalloc/vmalloc.h"
+
+// first-fit searches in a 90% full bitmap covering 4GiB worth of pages,
+// comparing a bit by bit scan, the word at a time search and the word at a time search with a summary
+
+static const uint64_t BIT_COUNT = 1048576; // 4GiB worth of pages
+static const uint64_t FREE_BIT_COUNT = 104857; // 10% of the bits are unset
+static const uint64_t MAX_RUN_LENGTH = 64;
+static const uint64_t ITERATIONS = 100;
+static const uint64_t RANGE_LENGTH = 8;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// sets every bit, then unsets random runs within the last `spread_bits` bits until 10% of them are unset
+static void fill(struct bitmap_t *bitmap, uint64_t spread_bits) {
+    rng_state = 0x2545f4914f6cdd1d;
+
+    bitmap_set_range(bitmap, 0, BIT_COUNT);
+
+    uint64_t spread_start = BIT_COUNT - spread_bits;
+    while (BIT_COUNT - bitmap_count_set(bitmap) < FREE_BIT_COUNT) {
+        uint64_t run_length = rng_next() % MAX_RUN_LENGTH + 1;
+        uint64_t run_start = spread_start + rng_next() % (spread_bits - run_length);
+        bitmap_unset_range(bitmap, run_start, run_length);
+    }
+}
+
+static uint64_t scan_find_zero_range(struct bitmap_t *bitmap, uint64_t n) {
+    uint64_t run_length = 0;
+    for (uint64_t i = 0; i < bitmap->bit_count; i++) {
+        if (bitmap_get_bit(bitmap, i)) {
+            run_length = 0;
+        } else if (++run_length == n) {
+            return i - n + 1;
+        }
+    }
+
+    return BITMAP_NOT_FOUND;
+}
+
+// first-fit allocates ITERATIONS runs of `n` bits, then frees them again; returns cycles per allocation
+static uint64_t run(struct bitmap_t *bitmap, uint64_t *handles, uint64_t n, bool scan) {
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < ITERATIONS; i++) {
+        if (scan) {
+            handles[i] = scan_find_zero_range(bitmap, n);
+        } else if (n == 1) {
+            handles[i] = bitmap_find_first_zero(bitmap);
+        } else {
+            handles[i] = bitmap_find_next_zero_range(bitmap, 0, n);
+        }
+        bitmap_set_range(bitmap, handles[i], n);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    for (uint64_t i = 0; i < ITERATIONS; i++) {
+        bitmap_unset_range(bitmap, handles[i], n);
+    }
+
+    return bench_per_op(cycles, ITERATIONS);
+}
+
+void bench_bitmap(void) {
+    uint64_t *words = vmalloc(bitmap_word_count(BIT_COUNT) * sizeof(uint64_t), VMALLOC_GUARD);
+    uint64_t *summary = kmalloc(bitmap_summary_word_count(BIT_COUNT) * sizeof(uint64_t));
+    uint64_t *handles = kmalloc(ITERATIONS * sizeof(uint64_t));
+
+    // both views share the same words; only the summarized one maintains the summary
+    struct bitmap_t summarized;
+    bitmap_init(&summarized, words, summary, BIT_COUNT);
+    struct bitmap_t plain = summarized;
+    plain.summary = NULL;
+
+    static const struct {
+        const char *name;
+        uint64_t spread_bits;
+    } layouts[] = {
+        { "scattered", BIT_COUNT },
+        { "clustered", BIT_COUNT / 5 },
+    };
+
+    for (uint64_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        fill(&summarized, layouts[i].spread_bits);
+
+        bool old_int_state = interrupts_set(false);
+
+        uint64_t scan_cycles = run(&plain, handles, 1, true);
+        uint64_t word_cycles = run(&plain, handles, 1, false);
+        uint64_t summary_cycles = run(&summarized, handles, 1, false);
+        uint64_t scan_range_cycles = run(&plain, handles, RANGE_LENGTH, true);
+        uint64_t word_range_cycles = run(&plain, handles, RANGE_LENGTH, false);
+        uint64_t summary_range_cycles = run(&summarized, handles, RANGE_LENGTH, false);
+
+        interrupts_set(old_int_state);
+
+        klog_info("bench bitmap: %s, %llu of %llu bits set",
+                layouts[i].name, bitmap_count_set(&summarized), BIT_COUNT);
+        klog_info("bench bitmap: find zero      scan %9llu  words %9llu  summary %9llu cycles/op",
+                scan_cycles, word_cycles, summary_cycles);
+        klog_info("bench bitmap: find %llu zeroes  scan %9llu  words %9llu  summary %9llu cycles/op",
+                RANGE_LENGTH, scan_range_cycles, word_range_cycles, summary_range_cycles);
+    }
+
+    kfree(handles);
+    kfree(summary);
+    vfree(words);
+}
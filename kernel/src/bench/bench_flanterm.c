@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "bench/bench.h"
+#include "dev/tty/flanterm.h"
+#include "klog/klog.h"
+#include "lib/align.h"
+#include "memory/vmm/vmm.h"
+
+// full-screen scrolls of the flanterm console, with the framebuffer mapped write-back
+// as it used to be, then write-combining as it is now
+
+static const uint64_t SCROLLS = 8;
+
+static uint64_t run(void) {
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < SCROLLS; i++) {
+        flanterm_tty_scroll_screen();
+    }
+    return bench_per_op(rdtsc() - start, SCROLLS);
+}
+
+void bench_flanterm(void) {
+    void *addr;
+    uint64_t size;
+    flanterm_tty_get_framebuffer(&addr, &size);
+    phys_t phys = (uintptr_t) addr - vmm_get_hhdm_offset();
+    phys_t start = align_down(phys, PAGE_SIZE);
+    phys_t end = align_up(phys + size, PAGE_SIZE);
+
+    bool old_int_state = interrupts_set(false);
+
+    vmm_map_hhdm_range(start, end, VMM_PAGE_CACHE_WB);
+    uint64_t wb_cycles = run();
+    vmm_map_hhdm_range(start, end, VMM_PAGE_CACHE_WC);
+    uint64_t wc_cycles = run();
+
+    interrupts_set(old_int_state);
+
+    klog_info("bench flanterm: %llu KiB framebuffer", size >> 10);
+    klog_info("bench flanterm: full-screen scroll  WB %12llu  WC %12llu cycles/op", wb_cycles, wc_cycles);
+}
@@ -0,0 +1,161 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "bench/bench.h"
+#include "klog/klog.h"
+#include "memory/kmalloc/kmalloc.h"
+
+// alloc/free latency of the size classes against the coalescing heap kmalloc used before them,
+// once on a fresh heap and once with its freelist fragmented by small holes,
+// then alloc/free throughput of both on more and more CPUs
+
+#define HOLE_COUNT 1024
+
+static const uint64_t ITERATIONS = 1024;
+static const uint64_t MAX_HOLE_SIZE = 512;
+static const uint64_t SMP_THREADS_PER_CPU = 4;
+static const uint64_t SMP_ITERATIONS = 2000;
+static const uint64_t SMP_BURST = 16;
+static const size_t SMP_OBJECT_SIZE = 64;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// allocates ITERATIONS objects of `sz` bytes, then frees them in the order they were allocated
+static void run(void **objects, size_t sz, bool heap, uint64_t *alloc_cycles, uint64_t *free_cycles) {
+    bool old_int_state = interrupts_set(false);
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < ITERATIONS; i++) {
+        objects[i] = heap ? kmalloc_heap(sz) : kmalloc(sz);
+    }
+    uint64_t mid = rdtsc();
+    for (uint64_t i = 0; i < ITERATIONS; i++) {
+        kfree(objects[i]);
+    }
+    uint64_t end = rdtsc();
+
+    interrupts_set(old_int_state);
+
+    *alloc_cycles = bench_per_op(mid - start, ITERATIONS);
+    *free_cycles = bench_per_op(end - mid, ITERATIONS);
+}
+
+static void run_sizes(void **objects, const char *layout) {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+
+    for (uint64_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t slab_alloc_cycles, slab_free_cycles, heap_alloc_cycles, heap_free_cycles;
+        run(objects, sizes[i], false, &slab_alloc_cycles, &slab_free_cycles);
+        run(objects, sizes[i], true, &heap_alloc_cycles, &heap_free_cycles);
+
+        klog_info("bench kmalloc: %s, %4llu B  alloc slab %6llu  heap %6llu  free slab %6llu  heap %6llu cycles/op",
+                layout, (uint64_t) sizes[i], slab_alloc_cycles, heap_alloc_cycles, slab_free_cycles, heap_free_cycles);
+    }
+}
+
+void bench_kmalloc(void) {
+    void **objects = kmalloc(ITERATIONS * sizeof(void *));
+
+    run_sizes(objects, "fresh heap");
+
+    // every other chunk is freed again, leaving holes no larger than MAX_HOLE_SIZE on the freelist
+    static void *chunks[HOLE_COUNT * 2];
+    rng_state = 0x2545f4914f6cdd1d;
+    for (uint64_t i = 0; i < HOLE_COUNT * 2; i++) {
+        chunks[i] = kmalloc_heap(rng_next() % MAX_HOLE_SIZE + 1);
+    }
+    for (uint64_t i = 0; i < HOLE_COUNT * 2; i += 2) {
+        kfree(chunks[i]);
+    }
+
+    run_sizes(objects, "fragmented heap");
+
+    for (uint64_t i = 1; i < HOLE_COUNT * 2; i += 2) {
+        kfree(chunks[i]);
+    }
+
+    struct kmalloc_class_stats_t stats;
+    kmalloc_get_class_stats(0, &stats);
+    klog_info("bench kmalloc: %llu B class left with %llu slabs, %llu of %llu objects used",
+            stats.size, stats.slab_count, stats.used_count, stats.capacity);
+
+    kfree(objects);
+}
+
+// allocates and frees bursts of objects, through the per-CPU caches or the heap
+static void kmalloc_smp_worker(void *arg) {
+    bool heap = (bool) arg;
+
+    void *objects[SMP_BURST];
+    for (uint64_t i = 0; i < SMP_ITERATIONS; i++) {
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            objects[j] = heap ? kmalloc_heap(SMP_OBJECT_SIZE) : kmalloc(SMP_OBJECT_SIZE);
+        }
+
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            kfree(objects[j]);
+        }
+    }
+}
+
+// a burst left behind by one worker for whichever comes next to free
+static void **smp_mailbox;
+
+// frees the objects another worker allocated, which mostly happens on another CPU
+static void kmalloc_smp_remote_worker(void *arg) {
+    (void) arg;
+
+    for (uint64_t i = 0; i < SMP_ITERATIONS; i++) {
+        void **objects = kmalloc(SMP_BURST * sizeof(void *));
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            objects[j] = kmalloc(SMP_OBJECT_SIZE);
+        }
+
+        objects = __atomic_exchange_n(&smp_mailbox, objects, __ATOMIC_ACQ_REL);
+        if (objects == NULL) {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            kfree(objects[j]);
+        }
+        kfree(objects);
+    }
+}
+
+void bench_kmalloc_smp(void) {
+    struct kmalloc_cache_stats_t before, after;
+    kmalloc_get_cache_stats(&before);
+
+    for (uint64_t cpu_count = 1; cpu_count != 0; cpu_count = bench_next_cpu_count(cpu_count)) {
+        uint64_t ops = cpu_count * SMP_THREADS_PER_CPU * SMP_ITERATIONS * SMP_BURST;
+        uint64_t cache_ns = bench_run_on_cpus(cpu_count, SMP_THREADS_PER_CPU, kmalloc_smp_worker, (void *) false);
+        uint64_t heap_ns = bench_run_on_cpus(cpu_count, SMP_THREADS_PER_CPU, kmalloc_smp_worker, (void *) true);
+        uint64_t remote_ns = bench_run_on_cpus(cpu_count, SMP_THREADS_PER_CPU, kmalloc_smp_remote_worker, NULL);
+
+        void **objects = __atomic_exchange_n(&smp_mailbox, NULL, __ATOMIC_ACQ_REL);
+        if (objects != NULL) {
+            for (uint64_t j = 0; j < SMP_BURST; j++) {
+                kfree(objects[j]);
+            }
+            kfree(objects);
+        }
+
+        klog_info("bench kmalloc smp: %3llu CPUs x %llu threads  caches %10llu  heap %10llu  remote frees %10llu allocs/s",
+                cpu_count, SMP_THREADS_PER_CPU, bench_per_sec(ops, cache_ns), bench_per_sec(ops, heap_ns),
+                bench_per_sec(ops, remote_ns));
+    }
+
+    kmalloc_get_cache_stats(&after);
+    klog_info("bench kmalloc smp: %llu refills, %llu drains, %llu objects freed remotely",
+            after.refill_count - before.refill_count, after.drain_count - before.drain_count,
+            after.remote_free_count - before.remote_free_count);
+}
@@ -0,0 +1,166 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "bench/bench.h"
+#include "klog/klog.h"
+#include "lib/bitmap/bitmap.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/pmm/pmm.h"
+
+// the linear bitmap scan used by the PMM before the buddy allocator,
+// run on a private bitmap so that it can serve as a baseline
+
+static const uint64_t LEGACY_PAGE_COUNT = 131072; // 512MiB worth of pages
+static const uint64_t LEGACY_USED_PAGE_COUNT = 98304; // 75% of the pages are in use
+static const uint64_t SINGLE_ITERATIONS = 1000;
+static const uint64_t MULTI_ITERATIONS = 100;
+static const uint64_t MULTI_PAGE_COUNT = 8;
+
+static uint64_t legacy_alloc(struct bitmap_t *bitmap) {
+    uint64_t page_index = 0;
+    while (page_index < bitmap->bit_count && bitmap_get_bit(bitmap, page_index)) {
+        page_index++;
+    }
+
+    bitmap_set_bit(bitmap, page_index);
+    return page_index;
+}
+
+static uint64_t legacy_alloc_n(struct bitmap_t *bitmap, uint64_t n_pages) {
+    bool found_n_pages = false;
+    uint64_t page_index = 0;
+    while (page_index < bitmap->bit_count - n_pages + 1) {
+        if (!bitmap_get_bit(bitmap, page_index)) {
+            found_n_pages = true;
+
+            for (uint64_t i = page_index; i < page_index + n_pages; i++) {
+                if (bitmap_get_bit(bitmap, i)) {
+                    found_n_pages = false;
+                    break;
+                }
+            }
+
+            if (found_n_pages) {
+                break;
+            }
+        }
+
+        page_index++;
+    }
+
+    for (uint64_t i = page_index; i < page_index + n_pages; i++) {
+        bitmap_set_bit(bitmap, i);
+    }
+
+    return page_index;
+}
+
+static void legacy_free_n(struct bitmap_t *bitmap, uint64_t page_index, uint64_t n_pages) {
+    for (uint64_t i = page_index; i < page_index + n_pages; i++) {
+        bitmap_unset_bit(bitmap, i);
+    }
+}
+
+void bench_pmm(void) {
+    uint64_t *handles = kmalloc(SINGLE_ITERATIONS * sizeof(uint64_t));
+
+    struct bitmap_t legacy;
+    bitmap_init(&legacy, kmalloc(bitmap_word_count(LEGACY_PAGE_COUNT) * sizeof(uint64_t)), NULL, LEGACY_PAGE_COUNT);
+    bitmap_set_range(&legacy, 0, LEGACY_USED_PAGE_COUNT);
+
+    bool old_int_state = interrupts_set(false);
+
+    // single pages, bitmap
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < SINGLE_ITERATIONS; i++) {
+        handles[i] = legacy_alloc(&legacy);
+    }
+    uint64_t legacy_alloc_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < SINGLE_ITERATIONS; i++) {
+        legacy_free_n(&legacy, handles[i], 1);
+    }
+    uint64_t legacy_free_cycles = rdtsc() - start;
+
+    // single pages, buddy
+    start = rdtsc();
+    for (uint64_t i = 0; i < SINGLE_ITERATIONS; i++) {
+        handles[i] = pmm_alloc(false);
+    }
+    uint64_t buddy_alloc_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < SINGLE_ITERATIONS; i++) {
+        pmm_free(handles[i]);
+    }
+    uint64_t buddy_free_cycles = rdtsc() - start;
+
+    // contiguous runs, bitmap
+    start = rdtsc();
+    for (uint64_t i = 0; i < MULTI_ITERATIONS; i++) {
+        handles[i] = legacy_alloc_n(&legacy, MULTI_PAGE_COUNT);
+    }
+    uint64_t legacy_alloc_n_cycles = rdtsc() - start;
+
+    for (uint64_t i = 0; i < MULTI_ITERATIONS; i++) {
+        legacy_free_n(&legacy, handles[i], MULTI_PAGE_COUNT);
+    }
+
+    // contiguous runs, buddy
+    start = rdtsc();
+    for (uint64_t i = 0; i < MULTI_ITERATIONS; i++) {
+        handles[i] = pmm_alloc_n(MULTI_PAGE_COUNT, false);
+    }
+    uint64_t buddy_alloc_n_cycles = rdtsc() - start;
+
+    for (uint64_t i = 0; i < MULTI_ITERATIONS; i++) {
+        pmm_free_n(handles[i], MULTI_PAGE_COUNT);
+    }
+
+    interrupts_set(old_int_state);
+
+    klog_info("bench pmm: bitmap baseline has %llu of %llu pages in use",
+            LEGACY_USED_PAGE_COUNT, LEGACY_PAGE_COUNT);
+    klog_info("bench pmm: alloc         bitmap %8llu cycles/op  buddy %8llu cycles/op",
+            bench_per_op(legacy_alloc_cycles, SINGLE_ITERATIONS),
+            bench_per_op(buddy_alloc_cycles, SINGLE_ITERATIONS));
+    klog_info("bench pmm: free          bitmap %8llu cycles/op  buddy %8llu cycles/op",
+            bench_per_op(legacy_free_cycles, SINGLE_ITERATIONS),
+            bench_per_op(buddy_free_cycles, SINGLE_ITERATIONS));
+    klog_info("bench pmm: alloc_n(%llu)    bitmap %8llu cycles/op  buddy %8llu cycles/op",
+            MULTI_PAGE_COUNT,
+            bench_per_op(legacy_alloc_n_cycles, MULTI_ITERATIONS),
+            bench_per_op(buddy_alloc_n_cycles, MULTI_ITERATIONS));
+
+    kfree(legacy.start);
+    kfree(handles);
+}
+
+static const uint64_t SMP_THREADS_PER_CPU = 4;
+static const uint64_t SMP_ITERATIONS = 2000;
+static const uint64_t SMP_BURST = 16;
+
+static void pmm_smp_worker(void *arg) {
+    (void) arg;
+
+    phys_t pages[SMP_BURST];
+    for (uint64_t i = 0; i < SMP_ITERATIONS; i++) {
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            pages[j] = pmm_alloc(false);
+        }
+
+        for (uint64_t j = 0; j < SMP_BURST; j++) {
+            pmm_free(pages[j]);
+        }
+    }
+}
+
+void bench_pmm_smp(void) {
+    for (uint64_t cpu_count = 1; cpu_count != 0; cpu_count = bench_next_cpu_count(cpu_count)) {
+        uint64_t ns = bench_run_on_cpus(cpu_count, SMP_THREADS_PER_CPU, pmm_smp_worker, NULL);
+        uint64_t pages = cpu_count * SMP_THREADS_PER_CPU * SMP_ITERATIONS * SMP_BURST;
+        klog_info("bench pmm smp: %3llu CPUs x %llu threads  %10llu pages/s",
+                cpu_count, SMP_THREADS_PER_CPU, bench_per_sec(pages, ns));
+    }
+}
@@ -0,0 +1,323 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "bench/bench.h"
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
+#include "memory/vmm/tlb.h"
+#include "memory/vmm/vmm.h"
+#include "mp/mp.h"
+#include "timer/timer.h"
+
+// mapping and unmapping as many pages as kmalloc_init maps for the heap,
+// one vmm_map_page call per page against a single cursor,
+// and translating them back with full walks against the walk cache
+
+static const uintptr_t BENCH_VIRT_START = 0xffffffffc0000000; // unused, below the kernel heap
+static const uintptr_t BENCH_VIRT_END = 0xffffffffd0000000; // where the kernel heap starts
+static const uint64_t PAGE_COUNT = 8192;
+static const uint64_t LOOKUP_ROUNDS = 16;
+
+// translates every page LOOKUP_ROUNDS times, plus an unmapped page after each; returns the time taken in ns
+static uint64_t lookup(phys_t pagemap, phys_t phys, bool cached) {
+    uintptr_t unmapped = BENCH_VIRT_START + PAGE_COUNT * PAGE_SIZE;
+    uint64_t start = timer_get_ns();
+    for (uint64_t round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (uint64_t i = 0; i < PAGE_COUNT; i++) {
+            uintptr_t virt = BENCH_VIRT_START + i * PAGE_SIZE;
+            phys_t page_phys = cached ? vmm_walk_page_cached(pagemap, virt) : vmm_walk_page(pagemap, virt);
+            kassert(page_phys == phys);
+            page_phys = cached ? vmm_walk_page_cached(pagemap, unmapped) : vmm_walk_page(pagemap, unmapped);
+            kassert(page_phys == 0);
+        }
+    }
+    return timer_get_ns() - start;
+}
+
+void bench_vmm(void) {
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    // every page maps the same frame, only the page tables are of interest
+    phys_t phys = pmm_alloc(true);
+    // both runs allocate the page tables when mapping and free them again when unmapping
+    uint64_t page_table_count = vmm_get_page_table_count();
+    struct vmm_cursor_t cursor;
+
+    bool old_int_state = interrupts_set(false);
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < PAGE_COUNT; i++) {
+        vmm_map_page(pagemap, BENCH_VIRT_START + i * PAGE_SIZE, phys, VMM_PAGE_WRITE | VMM_PAGE_NX);
+    }
+    uint64_t page_map_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < PAGE_COUNT; i++) {
+        vmm_unmap_page(pagemap, BENCH_VIRT_START + i * PAGE_SIZE);
+    }
+    uint64_t page_unmap_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    vmm_cursor_init(&cursor, pagemap, BENCH_VIRT_START);
+    for (uint64_t i = 0; i < PAGE_COUNT; i++) {
+        vmm_cursor_map(&cursor, phys, VMM_PAGE_WRITE | VMM_PAGE_NX);
+    }
+    vmm_cursor_finish(&cursor);
+    uint64_t cursor_map_cycles = rdtsc() - start;
+
+    // looking up unmapped pages must not allocate the page tables on the way to them
+    uint64_t lookup_page_table_count = vmm_get_page_table_count();
+    uint64_t walk_ns = lookup(pagemap, phys, false);
+    uint64_t cached_walk_ns = lookup(pagemap, phys, true);
+    kassert(vmm_get_page_table_count() == lookup_page_table_count);
+
+    start = rdtsc();
+    vmm_cursor_init(&cursor, pagemap, BENCH_VIRT_START);
+    for (uint64_t i = 0; i < PAGE_COUNT; i++) {
+        vmm_cursor_unmap(&cursor);
+    }
+    vmm_cursor_finish(&cursor);
+    uint64_t cursor_unmap_cycles = rdtsc() - start;
+
+    interrupts_set(old_int_state);
+
+    pmm_free(phys);
+
+    klog_info("bench vmm: %llu pages, page tables before %llu after %llu",
+            PAGE_COUNT, page_table_count, vmm_get_page_table_count());
+    klog_info("bench vmm: map    per page %6llu  cursor %6llu cycles/page",
+            bench_per_op(page_map_cycles, PAGE_COUNT), bench_per_op(cursor_map_cycles, PAGE_COUNT));
+    klog_info("bench vmm: unmap  per page %6llu  cursor %6llu cycles/page",
+            bench_per_op(page_unmap_cycles, PAGE_COUNT), bench_per_op(cursor_unmap_cycles, PAGE_COUNT));
+    uint64_t lookup_count = LOOKUP_ROUNDS * PAGE_COUNT * 2;
+    klog_info("bench vmm: lookup walk %10llu  cached %10llu lookups/s",
+            bench_per_sec(lookup_count, walk_ns), bench_per_sec(lookup_count, cached_walk_ns));
+}
+
+// every CPU unmaps pages in its own 2MiB slot, either one by one, each taking a shootdown,
+// or all at once with a cursor; all CPUs take the shootdowns, whether they unmap or not
+// the last page of each slot stays mapped, so that no CPU allocates or frees page tables,
+// and only the shootdowns are measured
+
+static const uint64_t SMP_PAGE_COUNT = 64;
+static const uint64_t SMP_ITERATIONS = 100;
+
+static uint64_t smp_next_slot;
+
+static void vmm_smp_worker(void *arg) {
+    bool batched = arg != NULL;
+
+    uint64_t slot = __atomic_fetch_add(&smp_next_slot, 1, __ATOMIC_SEQ_CST);
+    uintptr_t virt_start = BENCH_VIRT_START + slot * VMM_PAGE_SIZE_2M;
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    phys_t phys = pmm_alloc(false);
+
+    for (uint64_t i = 0; i < SMP_ITERATIONS; i++) {
+        // mapping over non-present entries takes no shootdown
+        struct vmm_cursor_t cursor;
+        vmm_cursor_init(&cursor, pagemap, virt_start);
+        for (uint64_t j = 0; j < SMP_PAGE_COUNT; j++) {
+            vmm_cursor_map(&cursor, phys, VMM_PAGE_WRITE | VMM_PAGE_NX);
+        }
+        vmm_cursor_finish(&cursor);
+
+        if (batched) {
+            vmm_unmap_range_contig(pagemap, virt_start, SMP_PAGE_COUNT);
+        } else {
+            for (uint64_t j = 0; j < SMP_PAGE_COUNT; j++) {
+                vmm_unmap_page(pagemap, virt_start + j * PAGE_SIZE);
+            }
+        }
+    }
+
+    pmm_free(phys);
+}
+
+void bench_vmm_smp(void) {
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    phys_t pin_phys = pmm_alloc(false);
+    // one slot per CPU, as long as they fit below the heap
+    uint64_t slot_count = mp_get_cpu_count();
+    uint64_t max_slot_count = (BENCH_VIRT_END - BENCH_VIRT_START) / VMM_PAGE_SIZE_2M;
+    if (slot_count > max_slot_count) {
+        klog_info("bench vmm smp: only room for %llu of %llu CPUs", max_slot_count, slot_count);
+        slot_count = max_slot_count;
+    }
+    for (uint64_t i = 0; i < slot_count; i++) {
+        vmm_map_page(pagemap, BENCH_VIRT_START + (i + 1) * VMM_PAGE_SIZE_2M - PAGE_SIZE, pin_phys, VMM_PAGE_NX);
+    }
+
+    for (uint64_t cpu_count = 1; cpu_count != 0 && cpu_count <= slot_count; cpu_count = bench_next_cpu_count(cpu_count)) {
+        uint64_t pages = cpu_count * SMP_ITERATIONS * SMP_PAGE_COUNT;
+
+        struct tlb_stats_t before, after;
+        tlb_get_stats(&before);
+        smp_next_slot = 0;
+        uint64_t page_ns = bench_run_on_cpus(cpu_count, 1, vmm_smp_worker, NULL);
+        tlb_get_stats(&after);
+        uint64_t wait_cycles = bench_per_op(after.wait_cycles - before.wait_cycles, after.shootdown_count - before.shootdown_count);
+
+        smp_next_slot = 0;
+        uint64_t batched_ns = bench_run_on_cpus(cpu_count, 1, vmm_smp_worker, (void *) 1);
+
+        klog_info("bench vmm smp: %3llu CPUs  unmap per page %10llu pages/s  batched %10llu pages/s  wait %8llu cycles/shootdown",
+                cpu_count, bench_per_sec(pages, page_ns), bench_per_sec(pages, batched_ns), wait_cycles);
+    }
+
+    for (uint64_t i = 0; i < slot_count; i++) {
+        vmm_unmap_page(pagemap, BENCH_VIRT_START + (i + 1) * VMM_PAGE_SIZE_2M - PAGE_SIZE);
+    }
+    pmm_free(pin_phys);
+}
+
+// all CPUs map and unmap pages in the same range at once, the pages of every pml1 spread over all of them,
+// racing to install and to free the page tables; after each round every page must map the frame it was
+// mapped to, and once all are unmapped, the page tables must be back to their count before
+
+#define STRESS_FRAME_COUNT 8
+
+static const uint64_t STRESS_PAGE_COUNT = 8192;
+static const uint64_t STRESS_CHUNK_PAGES = 64;
+static const uint64_t STRESS_ROUNDS = 10;
+
+static struct {
+    uint64_t cpu_count;
+    uint64_t next_worker;
+    phys_t frames[STRESS_FRAME_COUNT];
+} stress;
+
+static void vmm_stress_map_worker(void *arg) {
+    (void) arg;
+
+    uint64_t worker = __atomic_fetch_add(&stress.next_worker, 1, __ATOMIC_SEQ_CST);
+    phys_t pagemap = vmm_get_kernel_pagemap();
+
+    // neighbouring pages go to different CPUs
+    for (uint64_t i = worker; i < STRESS_PAGE_COUNT; i += stress.cpu_count) {
+        vmm_map_page(pagemap, BENCH_VIRT_START + i * PAGE_SIZE, stress.frames[i % STRESS_FRAME_COUNT], VMM_PAGE_WRITE | VMM_PAGE_NX);
+    }
+}
+
+static void vmm_stress_unmap_worker(void *arg) {
+    (void) arg;
+
+    uint64_t worker = __atomic_fetch_add(&stress.next_worker, 1, __ATOMIC_SEQ_CST);
+    phys_t pagemap = vmm_get_kernel_pagemap();
+
+    // whichever CPU unmaps the last chunk of a pml1 frees it
+    for (uint64_t i = worker * STRESS_CHUNK_PAGES; i < STRESS_PAGE_COUNT; i += stress.cpu_count * STRESS_CHUNK_PAGES) {
+        vmm_unmap_range_contig(pagemap, BENCH_VIRT_START + i * PAGE_SIZE, STRESS_CHUNK_PAGES);
+    }
+}
+
+void bench_vmm_stress(void) {
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    for (uint64_t i = 0; i < STRESS_FRAME_COUNT; i++) {
+        stress.frames[i] = pmm_alloc(false);
+    }
+
+    uint64_t page_table_count = vmm_get_page_table_count();
+    // page tables when every page is mapped, the same however many CPUs raced to allocate them
+    uint64_t mapped_page_table_count = 0;
+
+    for (uint64_t cpu_count = 1; cpu_count != 0; cpu_count = bench_next_cpu_count(cpu_count)) {
+        stress.cpu_count = cpu_count;
+        uint64_t map_ns = 0;
+        uint64_t unmap_ns = 0;
+
+        for (uint64_t round = 0; round < STRESS_ROUNDS; round++) {
+            stress.next_worker = 0;
+            map_ns += bench_run_on_cpus(cpu_count, 1, vmm_stress_map_worker, NULL);
+
+            for (uint64_t i = 0; i < STRESS_PAGE_COUNT; i++) {
+                kassert(vmm_walk_page(pagemap, BENCH_VIRT_START + i * PAGE_SIZE) == stress.frames[i % STRESS_FRAME_COUNT]);
+            }
+            if (mapped_page_table_count == 0) {
+                mapped_page_table_count = vmm_get_page_table_count();
+            }
+            kassert(vmm_get_page_table_count() == mapped_page_table_count);
+
+            stress.next_worker = 0;
+            unmap_ns += bench_run_on_cpus(cpu_count, 1, vmm_stress_unmap_worker, NULL);
+
+            for (uint64_t i = 0; i < STRESS_PAGE_COUNT; i++) {
+                kassert(vmm_walk_page(pagemap, BENCH_VIRT_START + i * PAGE_SIZE) == 0);
+            }
+            kassert(vmm_get_page_table_count() == page_table_count);
+        }
+
+        uint64_t pages = STRESS_ROUNDS * STRESS_PAGE_COUNT;
+        klog_info("bench vmm stress: %3llu CPUs  map %10llu pages/s  unmap %10llu pages/s",
+                cpu_count, bench_per_sec(pages, map_ns), bench_per_sec(pages, unmap_ns));
+    }
+
+    for (uint64_t i = 0; i < STRESS_FRAME_COUNT; i++) {
+        pmm_free(stress.frames[i]);
+    }
+}
+
+// committing the pages of a user space, cloning it, then writing to every page in the clone, which copies
+// them, and in the original, which takes them over again; cloning itself only copies page tables
+
+static const uintptr_t COW_VIRT_START = 0x400000000; // 16GiB, in the user half
+static const uint64_t COW_PAGE_COUNTS[] = { 256, 4096, 16384 };
+
+// returns cycles per page
+static uint64_t cow_touch(uint64_t page_count, uint64_t value) {
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < page_count; i++) {
+        *(volatile uint64_t *) (COW_VIRT_START + i * PAGE_SIZE) = value;
+    }
+    return bench_per_op(rdtsc() - start, page_count);
+}
+
+void bench_vmm_cow(void) {
+    for (uint64_t i = 0; i < sizeof(COW_PAGE_COUNTS) / sizeof(COW_PAGE_COUNTS[0]); i++) {
+        uint64_t page_count = COW_PAGE_COUNTS[i];
+
+        struct vmm_space_t *space = vmm_space_create(vmm_new_pagemap());
+        struct vmm_region_t region = {
+            .start = COW_VIRT_START,
+            .length = page_count * PAGE_SIZE,
+            .flags = VMM_PAGE_WRITE | VMM_PAGE_USER | VMM_PAGE_NX,
+            .backing = VMM_BACKING_ZERO,
+            .owner = PMM_OWNER_USER,
+            .movable = false
+        };
+        vmm_space_add_region(space, &region);
+
+        // user half faults are resolved in the space loaded on this CPU, so this thread must stay on it
+        bool old_int_state = interrupts_set(false);
+
+        vmm_space_load(space);
+        uint64_t commit_cycles = cow_touch(page_count, 1);
+
+        uint64_t page_table_count = vmm_get_page_table_count();
+        uint64_t start = rdtsc();
+        struct vmm_space_t *clone = vmm_space_clone(space);
+        uint64_t clone_cycles = rdtsc() - start;
+        page_table_count = vmm_get_page_table_count() - page_table_count;
+
+        vmm_space_load(clone);
+        uint64_t copy_cycles = cow_touch(page_count, 2);
+
+        vmm_space_load(space);
+        kassert(*(volatile uint64_t *) COW_VIRT_START == 1);
+        uint64_t take_over_cycles = cow_touch(page_count, 3);
+
+        vmm_space_load(vmm_get_kernel_space());
+        interrupts_set(old_int_state);
+
+        struct vmm_region_t *region_clone = vmm_space_find_region(clone, COW_VIRT_START);
+        vmm_space_remove_region(clone, region_clone);
+        kfree(region_clone);
+        vmm_space_destroy(clone);
+        vmm_space_remove_region(space, &region);
+        vmm_space_destroy(space);
+
+        klog_info("bench vmm cow: %6llu pages  clone %9llu cycles, %4llu page tables  per page: commit %6llu  copy %6llu  take over %6llu cycles",
+                page_count, clone_cycles, page_table_count, commit_cycles, copy_cycles, take_over_cycles);
+    }
+}
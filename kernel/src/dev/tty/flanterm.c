@@ -5,6 +5,8 @@
 
 static struct flanterm_context *ft_ctx;
 static struct tty_t flanterm_tty;
+static void *fb_addr;
+static uint64_t fb_size;
 
 static void flush(void) {
     ft_ctx->double_buffer_flush(ft_ctx);
@@ -32,9 +34,32 @@ struct tty_t *flanterm_tty_init(struct limine_framebuffer *fb) {
     );
 
     kassert(ft_ctx != NULL);
+
+    fb_addr = fb->address;
+    fb_size = fb->pitch * fb->height;
     
     flanterm_tty.do_flush = true;
     flanterm_tty.flush = flush;
     flanterm_tty.putchar = putchar;
     return &flanterm_tty;
 }
+
+void flanterm_tty_get_framebuffer(void **addr, uint64_t *size) {
+    *addr = fb_addr;
+    *size = fb_size;
+}
+
+void flanterm_tty_scroll_screen(void) {
+    // a different character each time, so that no cell is left as it was
+    static char c = 'a';
+
+    for (size_t row = 0; row < ft_ctx->rows; row++) {
+        for (size_t col = 0; col + 1 < ft_ctx->cols; col++) {
+            flanterm_putchar(ft_ctx, c);
+        }
+        flanterm_putchar(ft_ctx, '\n');
+    }
+    flush();
+
+    c = c == 'z' ? 'a' : c + 1;
+}
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "dev/tty/tty.h"
 #include "limine.h"
 
 struct tty_t *flanterm_tty_init(struct limine_framebuffer *fb);
+// where the framebuffer is mapped, and its size in bytes
+void flanterm_tty_get_framebuffer(void **addr, uint64_t *size);
+// scrolls the whole screen once with a screenful of new text, redrawing every character
+void flanterm_tty_scroll_screen(void);
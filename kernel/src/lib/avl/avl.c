@@ -0,0 +1,119 @@
+#include "kassert/kassert.h"
+#include "lib/avl/avl.h"
+
+static inline uint8_t height(struct avl_node_t *node) {
+    return node == NULL ? 0 : node->height;
+}
+
+static void update(struct avl_tree_t *tree, struct avl_node_t *node) {
+    uint8_t left_height = height(node->left);
+    uint8_t right_height = height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+
+    if (tree->update != NULL) {
+        tree->update(node);
+    }
+}
+
+static struct avl_node_t *rotate_left(struct avl_tree_t *tree, struct avl_node_t *node) {
+    struct avl_node_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update(tree, node);
+    update(tree, right);
+    return right;
+}
+
+static struct avl_node_t *rotate_right(struct avl_tree_t *tree, struct avl_node_t *node) {
+    struct avl_node_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update(tree, node);
+    update(tree, left);
+    return left;
+}
+
+// returns the new root of the subtree
+static struct avl_node_t *balance(struct avl_tree_t *tree, struct avl_node_t *node) {
+    update(tree, node);
+    int16_t factor = (int16_t) height(node->left) - height(node->right);
+
+    if (factor > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotate_left(tree, node->left);
+        }
+        return rotate_right(tree, node);
+    }
+
+    if (factor < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotate_right(tree, node->right);
+        }
+        return rotate_left(tree, node);
+    }
+
+    return node;
+}
+
+static struct avl_node_t *insert_node(struct avl_tree_t *tree, struct avl_node_t *root, struct avl_node_t *node) {
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        update(tree, node);
+        return node;
+    }
+
+    int cmp = tree->cmp(node, root);
+    kassert(cmp != 0);
+    if (cmp < 0) {
+        root->left = insert_node(tree, root->left, node);
+    } else {
+        root->right = insert_node(tree, root->right, node);
+    }
+
+    return balance(tree, root);
+}
+
+// unlinks the lowest node of the subtree into `min`
+static struct avl_node_t *remove_min(struct avl_tree_t *tree, struct avl_node_t *root, struct avl_node_t **min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = remove_min(tree, root->left, min);
+    return balance(tree, root);
+}
+
+static struct avl_node_t *remove_node(struct avl_tree_t *tree, struct avl_node_t *root, struct avl_node_t *node) {
+    kassert(root != NULL);
+
+    int cmp = tree->cmp(node, root);
+    if (cmp < 0) {
+        root->left = remove_node(tree, root->left, node);
+    } else if (cmp > 0) {
+        root->right = remove_node(tree, root->right, node);
+    } else {
+        kassert(root == node);
+        if (root->right == NULL) {
+            return root->left;
+        }
+
+        // the successor takes the place of the removed node
+        struct avl_node_t *min;
+        struct avl_node_t *right = remove_min(tree, root->right, &min);
+        min->left = root->left;
+        min->right = right;
+        root = min;
+    }
+
+    return balance(tree, root);
+}
+
+void avl_insert(struct avl_tree_t *tree, struct avl_node_t *node) {
+    tree->root = insert_node(tree, tree->root, node);
+}
+
+void avl_remove(struct avl_tree_t *tree, struct avl_node_t *node) {
+    tree->root = remove_node(tree, tree->root, node);
+}
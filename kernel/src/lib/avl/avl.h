@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// intrusive AVL tree; lookups are left to its users, which walk `left` and `right` themselves
+struct avl_node_t {
+    struct avl_node_t *left;
+    struct avl_node_t *right;
+    uint8_t height;
+};
+
+// the struct of type `type` containing `node` as `member`
+#define AVL_ENTRY(node, type, member) ((type *) ((char *) (node) - offsetof(type, member)))
+
+struct avl_tree_t {
+    struct avl_node_t *root;
+    // < 0, 0 or > 0 as `a` sorts before, with or after `b`; nodes must not compare equal
+    int (*cmp)(struct avl_node_t *a, struct avl_node_t *b);
+    // optional (may be NULL): called on each node whose subtree changed, after its children,
+    // so that data kept about the subtree can be recomputed
+    void (*update)(struct avl_node_t *node);
+};
+
+static inline void avl_init(struct avl_tree_t *tree,
+        int (*cmp)(struct avl_node_t *a, struct avl_node_t *b), void (*update)(struct avl_node_t *node)) {
+    tree->root = NULL;
+    tree->cmp = cmp;
+    tree->update = update;
+}
+
+void avl_insert(struct avl_tree_t *tree, struct avl_node_t *node);
+void avl_remove(struct avl_tree_t *tree, struct avl_node_t *node);
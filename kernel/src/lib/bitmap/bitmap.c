@@ -1,19 +1,220 @@
+#include <stddef.h>
+
 #include "lib/bitmap/bitmap.h"
 
+// the bitmap is stored as 64-bit words and searched a word at a time
+// bits past bit_count in the last word (and past the last word in the summary)
+// are kept set, so that searches never have to special-case the tail
+
+static const uint64_t FULL_WORD = ~0ull;
+
+// bits [0, n) of a word, n < 64
+static inline uint64_t low_mask(uint64_t n) {
+    return (1ull << n) - 1;
+}
+
+// compiles to tzcnt/bsf; `word` must not be 0
+static inline uint64_t first_set(uint64_t word) {
+    return __builtin_ctzll(word);
+}
+
+static inline uint64_t popcount(uint64_t word) {
+    word = word - ((word >> 1) & 0x5555555555555555ull);
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (word * 0x0101010101010101ull) >> 56;
+}
+
+static inline void summary_update(struct bitmap_t *bitmap, uint64_t word_index) {
+    if (bitmap->summary == NULL) {
+        return;
+    }
+
+    uint64_t summary_bit = 1ull << (word_index % 64);
+    if (bitmap->start[word_index] == FULL_WORD) {
+        bitmap->summary[word_index / 64] |= summary_bit;
+    } else {
+        bitmap->summary[word_index / 64] &= ~summary_bit;
+    }
+}
+
+// index of the first word at or after `word_index` that is not full, found through the summary
+static uint64_t summary_find_next_word(struct bitmap_t *bitmap, uint64_t word_index) {
+    uint64_t summary_word_count = bitmap_summary_word_count(bitmap->bit_count);
+    uint64_t summary_index = word_index / 64;
+    if (summary_index >= summary_word_count) {
+        return BITMAP_NOT_FOUND;
+    }
+
+    uint64_t summary_word = bitmap->summary[summary_index] | low_mask(word_index % 64);
+    while (summary_word == FULL_WORD) {
+        summary_index++;
+        if (summary_index == summary_word_count) {
+            return BITMAP_NOT_FOUND;
+        }
+        summary_word = bitmap->summary[summary_index];
+    }
+
+    return summary_index * 64 + first_set(~summary_word);
+}
+
+void bitmap_init(struct bitmap_t *bitmap, uint64_t *words, uint64_t *summary, uint64_t bit_count) {
+    uint64_t word_count = bitmap_word_count(bit_count);
+
+    bitmap->start = words;
+    bitmap->bit_count = bit_count;
+    bitmap->summary = summary;
+
+    for (uint64_t i = 0; i < word_count; i++) {
+        words[i] = 0;
+    }
+
+    if (summary != NULL) {
+        uint64_t summary_word_count = bitmap_summary_word_count(bit_count);
+        for (uint64_t i = 0; i < summary_word_count; i++) {
+            summary[i] = 0;
+        }
+
+        if (word_count % 64 != 0) {
+            summary[summary_word_count - 1] = ~low_mask(word_count % 64);
+        }
+    }
+
+    if (bit_count % 64 != 0) {
+        words[word_count - 1] = ~low_mask(bit_count % 64);
+        summary_update(bitmap, word_count - 1);
+    }
+}
+
 uint8_t bitmap_get_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit) {
-    uint64_t which_byte = bitmap_bit >> 3;
-    uint16_t which_bit_in_byte = bitmap_bit & 0x7;
-    return (bitmap->start[which_byte] & (1 << which_bit_in_byte)) >> which_bit_in_byte;
+    return (bitmap->start[bitmap_bit / 64] >> (bitmap_bit % 64)) & 1;
 }
 
 void bitmap_set_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit) {
-    uint64_t which_byte = bitmap_bit >> 3;
-    uint16_t which_bit_in_byte = bitmap_bit & 0x7;
-    bitmap->start[which_byte] |= 1 << which_bit_in_byte;
+    uint64_t word_index = bitmap_bit / 64;
+    bitmap->start[word_index] |= 1ull << (bitmap_bit % 64);
+    summary_update(bitmap, word_index);
 }
 
 void bitmap_unset_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit) {
-    uint64_t which_byte = bitmap_bit >> 3;
-    uint16_t which_bit_in_byte = bitmap_bit & 0x7;
-    bitmap->start[which_byte] &= ~(1 << which_bit_in_byte);
+    uint64_t word_index = bitmap_bit / 64;
+    bitmap->start[word_index] &= ~(1ull << (bitmap_bit % 64));
+    summary_update(bitmap, word_index);
+}
+
+// sets or unsets [first_bit, first_bit + bit_count), one word at a time
+static void update_range(struct bitmap_t *bitmap, uint64_t first_bit, uint64_t bit_count, bool set) {
+    while (bit_count > 0) {
+        uint64_t word_index = first_bit / 64;
+        uint64_t bit_in_word = first_bit % 64;
+        uint64_t bits_in_word = 64 - bit_in_word < bit_count ? 64 - bit_in_word : bit_count;
+        uint64_t mask = bits_in_word == 64 ? FULL_WORD : low_mask(bits_in_word) << bit_in_word;
+
+        if (set) {
+            bitmap->start[word_index] |= mask;
+        } else {
+            bitmap->start[word_index] &= ~mask;
+        }
+        summary_update(bitmap, word_index);
+
+        first_bit += bits_in_word;
+        bit_count -= bits_in_word;
+    }
+}
+
+void bitmap_set_range(struct bitmap_t *bitmap, uint64_t first_bit, uint64_t bit_count) {
+    update_range(bitmap, first_bit, bit_count, true);
+}
+
+void bitmap_unset_range(struct bitmap_t *bitmap, uint64_t first_bit, uint64_t bit_count) {
+    update_range(bitmap, first_bit, bit_count, false);
+}
+
+uint64_t bitmap_find_first_zero(struct bitmap_t *bitmap) {
+    return bitmap_find_next_zero(bitmap, 0);
+}
+
+uint64_t bitmap_find_next_zero(struct bitmap_t *bitmap, uint64_t from_bit) {
+    if (from_bit >= bitmap->bit_count) {
+        return BITMAP_NOT_FOUND;
+    }
+
+    uint64_t word_count = bitmap_word_count(bitmap->bit_count);
+    uint64_t word_index = from_bit / 64;
+    // bits before `from_bit` are treated as set
+    uint64_t word = bitmap->start[word_index] | low_mask(from_bit % 64);
+
+    while (word == FULL_WORD) {
+        word_index++;
+        if (bitmap->summary != NULL) {
+            word_index = summary_find_next_word(bitmap, word_index);
+            if (word_index == BITMAP_NOT_FOUND) {
+                return BITMAP_NOT_FOUND;
+            }
+        } else if (word_index == word_count) {
+            return BITMAP_NOT_FOUND;
+        }
+        word = bitmap->start[word_index];
+    }
+
+    uint64_t bit = word_index * 64 + first_set(~word);
+    return bit < bitmap->bit_count ? bit : BITMAP_NOT_FOUND;
+}
+
+uint64_t bitmap_find_next_set(struct bitmap_t *bitmap, uint64_t from_bit) {
+    if (from_bit >= bitmap->bit_count) {
+        return BITMAP_NOT_FOUND;
+    }
+
+    uint64_t word_count = bitmap_word_count(bitmap->bit_count);
+    uint64_t word_index = from_bit / 64;
+    // bits before `from_bit` are treated as unset
+    uint64_t word = bitmap->start[word_index] & ~low_mask(from_bit % 64);
+
+    while (word == 0) {
+        word_index++;
+        if (word_index == word_count) {
+            return BITMAP_NOT_FOUND;
+        }
+        word = bitmap->start[word_index];
+    }
+
+    // the tail bits are set, so they have to be filtered out here
+    uint64_t bit = word_index * 64 + first_set(word);
+    return bit < bitmap->bit_count ? bit : BITMAP_NOT_FOUND;
+}
+
+uint64_t bitmap_find_next_zero_range(struct bitmap_t *bitmap, uint64_t from_bit, uint64_t n) {
+    while (true) {
+        uint64_t run_start = bitmap_find_next_zero(bitmap, from_bit);
+        if (run_start == BITMAP_NOT_FOUND) {
+            return BITMAP_NOT_FOUND;
+        }
+
+        uint64_t run_end = bitmap_find_next_set(bitmap, run_start);
+        if (run_end == BITMAP_NOT_FOUND) {
+            run_end = bitmap->bit_count;
+        }
+
+        if (run_end - run_start >= n) {
+            return run_start;
+        }
+
+        if (run_end == bitmap->bit_count) {
+            return BITMAP_NOT_FOUND;
+        }
+
+        from_bit = run_end;
+    }
+}
+
+uint64_t bitmap_count_set(struct bitmap_t *bitmap) {
+    uint64_t word_count = bitmap_word_count(bitmap->bit_count);
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < word_count; i++) {
+        count += popcount(bitmap->start[i]);
+    }
+
+    // minus the tail bits
+    return count - (word_count * 64 - bitmap->bit_count);
 }
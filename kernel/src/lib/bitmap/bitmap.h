@@ -1,13 +1,44 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// returned by the search functions when no matching bit exists
+#define BITMAP_NOT_FOUND UINT64_MAX
+
 struct bitmap_t {
-    uint8_t *start;
+    uint64_t *start;
     uint64_t bit_count;
     // ^ uint32_t may not suffice; the bitmap would only keep track of 16384 GiB :)
+
+    // optional (may be NULL): one bit per word of `start`, set when that word is all ones,
+    // so that searches in a mostly-full bitmap can skip 64 words (8 cache lines) at a time
+    uint64_t *summary;
 };
 
+static inline uint64_t bitmap_word_count(uint64_t bit_count) {
+    return (bit_count + 63) / 64;
+}
+
+static inline uint64_t bitmap_summary_word_count(uint64_t bit_count) {
+    return bitmap_word_count(bitmap_word_count(bit_count));
+}
+
+// `words` must hold bitmap_word_count(bit_count) words and `summary`, if not NULL,
+// bitmap_summary_word_count(bit_count) words; all bits start out unset
+void bitmap_init(struct bitmap_t *bitmap, uint64_t *words, uint64_t *summary, uint64_t bit_count);
+
 uint8_t bitmap_get_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit);
 void bitmap_set_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit);
 void bitmap_unset_bit(struct bitmap_t *bitmap, uint64_t bitmap_bit);
+
+void bitmap_set_range(struct bitmap_t *bitmap, uint64_t first_bit, uint64_t bit_count);
+void bitmap_unset_range(struct bitmap_t *bitmap, uint64_t first_bit, uint64_t bit_count);
+
+uint64_t bitmap_find_first_zero(struct bitmap_t *bitmap);
+uint64_t bitmap_find_next_zero(struct bitmap_t *bitmap, uint64_t from_bit);
+uint64_t bitmap_find_next_set(struct bitmap_t *bitmap, uint64_t from_bit);
+// first run of `n` unset bits starting at or after `from_bit`
+uint64_t bitmap_find_next_zero_range(struct bitmap_t *bitmap, uint64_t from_bit, uint64_t n);
+
+uint64_t bitmap_count_set(struct bitmap_t *bitmap);
@@ -19,6 +19,10 @@ static inline void spin_lock(struct spinlock_t *spinlock) {
     }
 }
 
+static inline bool spin_trylock(struct spinlock_t *spinlock) {
+    return !__atomic_test_and_set(&spinlock->lock, __ATOMIC_ACQUIRE);
+}
+
 static inline void spin_unlock(struct spinlock_t *spinlock) {
     __atomic_clear(&spinlock->lock, __ATOMIC_RELEASE);
 }
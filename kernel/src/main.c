@@ -1,11 +1,14 @@
 #include "acpi/acpi.h"
 #include "acpi/madt.h"
+#include "acpi/slit.h"
+#include "acpi/srat.h"
 #include "arch/x86_64/apic/ioapic.h"
 #include "arch/x86_64/apic/lapic.h"
 #include "arch/x86_64/asm.h"
 #include "arch/x86_64/gdt/gdt.h"
 #include "arch/x86_64/idt/idt.h"
 #include "arch/x86_64/interrupts/interrupts.h"
+#include "bench/bench.h"
 #include "dev/tty/debugcon.h"
 #include "dev/tty/flanterm.h"
 // #include "dev/tty/serial.h"
@@ -15,6 +18,9 @@
 #include "limine.h"
 #include "memory/kmalloc/kmalloc.h"
 #include "memory/pmm/pmm.h"
+#include "memory/vmalloc/vmalloc.h"
+#include "memory/vmm/space.h"
+#include "memory/vmm/tlb.h"
 #include "memory/vmm/vmm.h"
 #include "mp/mp.h"
 #include "sched/sched.h"
@@ -83,9 +89,39 @@ static void *test_thread(void *arg) {
     return NULL;
 }
 
+static uint64_t cpus_off_boot_stack;
+
+static void *leave_boot_stack(void *arg) {
+    (void) arg;
+    __atomic_fetch_add(&cpus_off_boot_stack, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+// every CPU starts out on a stack in bootloader reclaimable memory and only leaves it
+// with its first context switch; a thread pinned to a CPU getting to run proves that it did
+static void reclaim_bootloader_memory(void) {
+    uint64_t cpu_count = mp_get_cpu_count();
+    for (uint64_t i = 0; i < cpu_count; i++) {
+        sched_new_kthread_on(mp_get_cpus()[i], leave_boot_stack, NULL);
+    }
+
+    while (__atomic_load_n(&cpus_off_boot_stack, __ATOMIC_SEQ_CST) != cpu_count) {
+        sched_yield();
+    }
+
+    pmm_reclaim_bootloader_memory();
+}
+
 static void *kernel_init(void *arg) {
     (void) arg;
 
+    // everything reading Limine responses is done with them by now
+    reclaim_bootloader_memory();
+
+#ifdef BENCH
+    bench_run_all();
+#endif
+
     for (size_t i = 0; i < 10; i++) {
         sched_new_kthread(test_thread, (void *) (uint64_t) 500000);
         sched_new_kthread(test_thread, (void *) (uint64_t) 400000);
@@ -94,6 +130,41 @@ static void *kernel_init(void *arg) {
         sched_new_kthread(test_thread, (void *) (uint64_t) 100000);
     }
 
+    struct pmm_zeroed_pool_stats_t zeroed_pool_stats;
+    pmm_get_zeroed_pool_stats(&zeroed_pool_stats);
+    klog_debug("PMM zeroed pool: %llu pages, %llu hits, %llu misses",
+            zeroed_pool_stats.page_count, zeroed_pool_stats.hits, zeroed_pool_stats.misses);
+
+    for (uint32_t node = 0; node < pmm_get_node_count(); node++) {
+        struct pmm_node_stats_t node_stats;
+        pmm_get_node_stats(node, &node_stats);
+        klog_debug("PMM node %llu: %llu free pages, %llu pages allocated locally, %llu remotely",
+                (uint64_t) node, node_stats.free_page_count, node_stats.local_alloc_count, node_stats.remote_alloc_count);
+    }
+
+    struct pmm_compaction_stats_t compaction_stats;
+    pmm_get_compaction_stats(&compaction_stats);
+    klog_debug("PMM compaction: %llu of %llu runs succeeded, %llu pages moved, %llu KiB recovered in %llu us",
+            compaction_stats.success_count, compaction_stats.run_count, compaction_stats.migrated_page_count,
+            compaction_stats.recovered_page_count * PAGE_SIZE >> 10, compaction_stats.time_ns / 1000);
+
+    struct tlb_stats_t tlb_stats;
+    tlb_get_stats(&tlb_stats);
+    klog_debug("TLB: %llu flushes, %llu in full, %llu shootdowns with %llu IPIs, waited %llu cycles on average, %llu at most",
+            tlb_stats.flush_count, tlb_stats.full_flush_count, tlb_stats.shootdown_count, tlb_stats.ipi_count,
+            tlb_stats.shootdown_count == 0 ? 0 : tlb_stats.wait_cycles / tlb_stats.shootdown_count, tlb_stats.max_wait_cycles);
+
+    klog_debug("VMM page tables: %llu KiB", vmm_get_page_table_count() * PAGE_SIZE >> 10);
+
+    struct vmm_fault_stats_t fault_stats;
+    vmm_get_fault_stats(&fault_stats);
+    klog_debug("VMM page faults: %llu, %llu spurious, %llu cycles on average, %llu at most",
+            fault_stats.fault_count, fault_stats.spurious_count,
+            fault_stats.fault_count == 0 ? 0 : fault_stats.time_cycles / fault_stats.fault_count, fault_stats.max_time_cycles);
+
+    pmm_dump_stats();
+    kmalloc_dump_stats();
+
     klog_info("Kernel init thread done");
     return NULL;
 }
@@ -162,10 +233,17 @@ void kernel_entry(void) {
     pmm_init(memmap);
     pmm_print_memmap(memmap);
     vmm_init(memmap, executable_addr);
+    pmm_init_pages();
+    vmm_init_table_counts();
+    vmm_space_init();
     kmalloc_init();
+    vmalloc_init();
     symbols_init(executable_file->executable_file->address);
     acpi_init(rsdp->address);
     madt_init();
+    srat_init();
+    slit_init();
+    pmm_init_numa();
     lapic_init();
     lapic_init_cpu();
     ioapic_init();
@@ -173,7 +251,10 @@ void kernel_entry(void) {
     lapic_timer_calibrate();
     sched_init();
     sched_init_cpu();
+    tlb_init();
     mp_init(mp);
+    pmm_init_zeroed_pool();
+    pmm_init_compaction();
     sched_new_kthread(kernel_init, NULL);
     interrupts_set(true);
     sched_yield();
@@ -1,17 +1,22 @@
 #include <stddef.h>
 
+#include "arch/x86_64/asm.h"
 #include "kassert/kassert.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
 #include "lib/align.h"
 #include "lib/list/dlist.h"
+#include "lib/memutil.h"
 #include "lib/spinlock/spinlock.h"
 #include "memory/kmalloc/kmalloc.h"
 #include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
 #include "memory/vmm/vmm.h"
+#include "mp/cpu.h"
 
 static const uintptr_t HEAP_START = 0xffffffffd0000000;
-static const uintptr_t HEAP_SIZE = 0x2000000;
+// only reserved, pages are committed as they are first touched
+static const uintptr_t HEAP_SIZE = 0x10000000;
 static const uintptr_t HEAP_END = HEAP_START + HEAP_SIZE;
 
 static const uint64_t HEAP_ALIGNMENT = 8;
@@ -22,6 +27,76 @@ static const uint64_t FLAG_IS_PREV_FREE = 0x2;
 
 static struct spinlock_t kmalloc_lock = SPINLOCK_STATIC_INIT;
 
+static struct vmm_region_t heap_region;
+
+// allocations of up to SLAB_MAX_OBJECT_SIZE bytes are rounded up to a size class and served from slabs,
+// naturally aligned blocks of SLAB_SIZE bytes holding objects of a single class
+// only larger allocations are carved out of the heap
+static const uintptr_t SLABS_START = HEAP_END;
+// only reserved like the heap
+static const uintptr_t SLABS_SIZE = 0x10000000;
+static const uintptr_t SLABS_END = SLABS_START + SLABS_SIZE;
+static const uint64_t SLAB_SIZE = 0x10000;
+static const uint64_t SLAB_MAX_OBJECT_SIZE = 4096;
+// objects start after the slab header, on their own cache line
+static const uint64_t SLAB_OBJECTS_OFFSET = 64;
+
+// powers of two and the sizes halfway in between, see size_to_class
+static const uint32_t CLASS_SIZES[KMALLOC_CLASS_COUNT] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+// placed at the start of every slab
+struct slab_t {
+    // freed objects, linked through their first word
+    void *free_objects;
+    // objects from here on were never handed out, their pages are committed as they are first touched
+    uintptr_t untouched;
+    uint8_t class;
+    // objects handed out, including those sitting in the per-CPU caches
+    uint32_t used_count;
+    // the cache last refilled from this slab, which gets the objects freed on other CPUs
+    struct kmalloc_cache_t *owner;
+    struct {
+        struct slab_t *prev;
+        struct slab_t *next;
+    } links;
+};
+
+_Static_assert(sizeof(struct slab_t) <= 64, "struct slab_t must fit before the first object");
+
+struct size_class_t {
+    uint32_t size;
+    uint32_t objects_per_slab;
+    struct spinlock_t lock;
+    // slabs with free objects; full ones are not listed until an object is freed
+    // a slab that becomes empty is kept if it is the only one, and given back otherwise
+    DLIST_HEAD(partial_slabs, struct slab_t);
+    uint64_t slab_count;
+    uint64_t used_count;
+};
+
+static struct size_class_t size_classes[KMALLOC_CLASS_COUNT];
+
+static struct vmm_region_t slab_region;
+
+static struct spinlock_t slabs_lock = SPINLOCK_STATIC_INIT;
+// slabs given back by their class, handed out again before fresh ones
+// their pages stay committed, since the slab region is movable and thus never decommitted
+static DLIST_HEAD(empty_slabs, struct slab_t);
+static uint64_t empty_slab_count;
+// the slab region is used up from the bottom
+static uintptr_t next_fresh_slab;
+
+// objects are handed out from and freed to per-CPU caches without taking a lock,
+// which exchange them with the slabs in batches under the lock of their class
+// an object freed on another CPU than the one owning its slab goes back to the owner,
+// pushed onto a lock-free list that the owner takes in as a whole when it runs out or fills up
+// once REMOTE_FREE_LIMIT objects of a class pile up there, the CPU freeing the last one
+// gives the whole list back to the slabs instead
+static DLIST_HEAD_SYNCED(caches, struct kmalloc_cache_t);
+static const uint64_t REMOTE_FREE_LIMIT = KMALLOC_MAGAZINE_SIZE * 2;
+
 // free chunks are kept on a doubly linked freelist
 struct free_node_t {
     size_t chunk_metadata; // do not move
@@ -103,7 +178,7 @@ static void freelist_remove_node(struct free_node_t *node_to_remove) {
     DLIST_DELETE(freelist, node_to_remove, links);
 }
 
-void *kmalloc(size_t sz) {
+static void *heap_alloc(size_t sz) {
     size_t needed_sz = sz + sizeof(struct alloc_hdr_t);
     needed_sz = align_sz(needed_sz);
  
@@ -178,18 +253,10 @@ void *kmalloc(size_t sz) {
     spin_unlock_irqrestore(&kmalloc_lock);
 
     // return the address after the allocation header
-    void *ret = (void *) ((uintptr_t) alloc_hdr + sizeof(struct alloc_hdr_t));
-
-    // zero out memory for security reasons
-    uint8_t *p = ret;
-    for (size_t i = 0; i < sz; i++) {
-        p[i] = 0;
-    }
-
-    return ret;
+    return (void *) ((uintptr_t) alloc_hdr + sizeof(struct alloc_hdr_t));
 }
 
-void kfree(void *ptr) {
+static void heap_free(void *ptr) {
     spin_lock_irqsave(&kmalloc_lock);
 
     uintptr_t ptr_addr = (uintptr_t) ptr;
@@ -284,12 +351,353 @@ void kfree(void *ptr) {
     spin_unlock_irqrestore(&kmalloc_lock);
 }
 
-void kmalloc_init(void) {
-    for (uintptr_t virt = HEAP_START; virt < HEAP_END; virt += PAGE_SIZE) {
-        phys_t phys = pmm_alloc(true);
-        vmm_map_page(vmm_get_kernel_pagemap(), virt, phys, VMM_PAGE_WRITE | VMM_PAGE_NX);
+static inline bool is_in_slabs_bounds(uintptr_t addr) {
+    return addr >= SLABS_START && addr < SLABS_END;
+}
+
+static inline struct slab_t *slab_of(void *object) {
+    return (struct slab_t *) align_down((uintptr_t) object, SLAB_SIZE);
+}
+
+static uint8_t size_to_class(size_t sz) {
+    if (sz <= CLASS_SIZES[0]) {
+        return 0;
+    }
+
+    // with 2^order < sz <= 2^(order + 1), sz fits either the 1.5 * 2^order class or the 2^(order + 1) one
+    uint8_t order = 63 - __builtin_clzll(sz - 1);
+    uint8_t class = 2 * (order - 4);
+    return sz <= (3ull << (order - 1)) ? class + 1 : class + 2;
+}
+
+// must be called with the lock of the class held
+static struct slab_t *new_slab(uint8_t class) {
+    spin_lock_irqsave(&slabs_lock);
+
+    struct slab_t *slab = empty_slabs.head;
+    if (slab != NULL) {
+        DLIST_DELETE(empty_slabs, slab, links);
+        empty_slab_count--;
+    } else if (next_fresh_slab < SLABS_END) {
+        slab = (struct slab_t *) next_fresh_slab;
+        next_fresh_slab += SLAB_SIZE;
+    }
+
+    spin_unlock_irqrestore(&slabs_lock);
+
+    if (slab == NULL) {
+        kpanic("Kernel heap out of memory - no slab left for %llu byte objects", (uint64_t) CLASS_SIZES[class]);
+    }
+
+    slab->free_objects = NULL;
+    slab->untouched = (uintptr_t) slab + SLAB_OBJECTS_OFFSET;
+    slab->class = class;
+    slab->used_count = 0;
+    slab->owner = NULL;
+    size_classes[class].slab_count++;
+    return slab;
+}
+
+// must be called with the lock of the class held
+static void release_slab(struct slab_t *slab) {
+    size_classes[slab->class].slab_count--;
+
+    spin_lock_irqsave(&slabs_lock);
+    DLIST_INSERT(empty_slabs, slab, links);
+    empty_slab_count++;
+    spin_unlock_irqrestore(&slabs_lock);
+}
+
+// must be called with the lock of the class held
+static void *slab_alloc_locked(uint8_t class_index, struct kmalloc_cache_t *owner) {
+    struct size_class_t *class = &size_classes[class_index];
+
+    struct slab_t *slab = class->partial_slabs.head;
+    if (slab == NULL) {
+        slab = new_slab(class_index);
+        DLIST_INSERT(class->partial_slabs, slab, links);
+    }
+
+    void *object = slab->free_objects;
+    if (object != NULL) {
+        slab->free_objects = *(void **) object;
+    } else {
+        object = (void *) slab->untouched;
+        slab->untouched += class->size;
+    }
+
+    __atomic_store_n(&slab->owner, owner, __ATOMIC_RELAXED);
+    slab->used_count++;
+    class->used_count++;
+    if (slab->used_count == class->objects_per_slab) {
+        DLIST_DELETE(class->partial_slabs, slab, links);
+    }
+
+    return object;
+}
+
+// must be called with the lock of the class held
+static void slab_free_locked(void *ptr) {
+    struct slab_t *slab = slab_of(ptr);
+    struct size_class_t *class = &size_classes[slab->class];
+    kassert(((uintptr_t) ptr - (uintptr_t) slab - SLAB_OBJECTS_OFFSET) % class->size == 0);
+    kassert(slab->used_count > 0);
+
+    if (slab->used_count == class->objects_per_slab) {
+        DLIST_INSERT(class->partial_slabs, slab, links);
+    }
+
+    *(void **) ptr = slab->free_objects;
+    slab->free_objects = ptr;
+    slab->used_count--;
+    class->used_count--;
+
+    bool only_slab = class->partial_slabs.head == slab && slab->links.next == NULL;
+    if (slab->used_count == 0 && !only_slab) {
+        DLIST_DELETE(class->partial_slabs, slab, links);
+        release_slab(slab);
+    }
+}
+
+// the magazine functions must be called with interrupts disabled, on the CPU owning the cache
+static void magazine_refill(struct kmalloc_cache_t *cache, uint8_t class) {
+    struct kmalloc_magazine_t *magazine = &cache->magazines[class];
+
+    spin_lock(&size_classes[class].lock);
+    while (magazine->count < KMALLOC_MAGAZINE_BATCH) {
+        magazine->objects[magazine->count++] = slab_alloc_locked(class, cache);
+    }
+    spin_unlock(&size_classes[class].lock);
+
+    cache->refill_count++;
+}
+
+static void magazine_drain(struct kmalloc_cache_t *cache, uint8_t class) {
+    struct kmalloc_magazine_t *magazine = &cache->magazines[class];
+
+    spin_lock(&size_classes[class].lock);
+    for (uint64_t i = 0; i < KMALLOC_MAGAZINE_BATCH; i++) {
+        slab_free_locked(magazine->objects[--magazine->count]);
+    }
+    spin_unlock(&size_classes[class].lock);
+
+    cache->drain_count++;
+}
+
+static void magazine_push(struct kmalloc_cache_t *cache, void *object) {
+    uint8_t class = slab_of(object)->class;
+    struct kmalloc_magazine_t *magazine = &cache->magazines[class];
+    if (magazine->count == KMALLOC_MAGAZINE_SIZE) {
+        magazine_drain(cache, class);
+    }
+
+    magazine->objects[magazine->count++] = object;
+}
+
+// takes all the objects other CPUs freed to `cache` off its list at once
+// only ever emptied as a whole, so the list cannot change under the taker like a popped node could
+static void *take_remote_frees(struct kmalloc_cache_t *cache) {
+    if (__atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+
+    return __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+}
+
+// takes in the objects other CPUs freed to this cache
+static void collect_remote_frees(struct kmalloc_cache_t *cache) {
+    void *object = take_remote_frees(cache);
+    while (object != NULL) {
+        void *next = *(void **) object;
+        __atomic_fetch_sub(&cache->remote_free_pending[slab_of(object)->class], 1, __ATOMIC_RELAXED);
+        magazine_push(cache, object);
+        cache->remote_free_count++;
+        object = next;
+    }
+}
+
+// gives the objects other CPUs freed to `owner` straight back to their slabs,
+// for an owner that lets them pile up by not allocating
+static void reclaim_remote_frees(struct kmalloc_cache_t *cache, struct kmalloc_cache_t *owner) {
+    void *object = take_remote_frees(owner);
+    while (object != NULL) {
+        void *next = *(void **) object;
+        uint8_t class = slab_of(object)->class;
+        __atomic_fetch_sub(&owner->remote_free_pending[class], 1, __ATOMIC_RELAXED);
+
+        spin_lock(&size_classes[class].lock);
+        slab_free_locked(object);
+        spin_unlock(&size_classes[class].lock);
+
+        cache->remote_free_count++;
+        object = next;
+    }
+}
+
+static void remote_free(struct kmalloc_cache_t *cache, struct kmalloc_cache_t *owner, void *object) {
+    // counted before the push, so that the count is never below the length of the list
+    uint8_t class = slab_of(object)->class;
+    uint64_t pending = __atomic_add_fetch(&owner->remote_free_pending[class], 1, __ATOMIC_RELAXED);
+
+    void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **) object = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, object,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (pending >= REMOTE_FREE_LIMIT) {
+        reclaim_remote_frees(cache, owner);
+    }
+}
+
+static void *cache_alloc(uint8_t class) {
+    bool old_int_state = interrupts_set(false);
+
+    struct kmalloc_cache_t *cache = &get_cpu()->kmalloc_cache;
+    struct kmalloc_magazine_t *magazine = &cache->magazines[class];
+    if (magazine->count == 0) {
+        collect_remote_frees(cache);
+    }
+    if (magazine->count == 0) {
+        magazine_refill(cache, class);
     }
 
+    void *object = magazine->objects[--magazine->count];
+
+    interrupts_set(old_int_state);
+    return object;
+}
+
+static void cache_free(void *ptr) {
+    bool old_int_state = interrupts_set(false);
+
+    struct kmalloc_cache_t *cache = &get_cpu()->kmalloc_cache;
+    // the owner changes with every refill from the slab, possibly on another CPU;
+    // reading a stale one only sends the object to a CPU that refilled from the slab a little earlier
+    struct kmalloc_cache_t *owner = __atomic_load_n(&slab_of(ptr)->owner, __ATOMIC_RELAXED);
+    if (owner != cache) {
+        remote_free(cache, owner, ptr);
+    } else {
+        // a CPU that mostly frees would otherwise only take in its remote frees once it runs out
+        if (cache->magazines[slab_of(ptr)->class].count == KMALLOC_MAGAZINE_SIZE) {
+            collect_remote_frees(cache);
+        }
+        magazine_push(cache, ptr);
+    }
+
+    interrupts_set(old_int_state);
+}
+
+void *kmalloc(size_t sz) {
+    void *ret = sz <= SLAB_MAX_OBJECT_SIZE ? cache_alloc(size_to_class(sz)) : heap_alloc(sz);
+
+    // zero out memory for security reasons
+    memset(ret, 0, sz);
+    return ret;
+}
+
+void *kmalloc_heap(size_t sz) {
+    void *ret = heap_alloc(sz);
+    memset(ret, 0, sz);
+    return ret;
+}
+
+void kfree(void *ptr) {
+    if (is_in_slabs_bounds((uintptr_t) ptr)) {
+        cache_free(ptr);
+    } else {
+        heap_free(ptr);
+    }
+}
+
+void kmalloc_get_class_stats(uint8_t class, struct kmalloc_class_stats_t *stats) {
+    kassert(class < KMALLOC_CLASS_COUNT);
+
+    spin_lock_irqsave(&size_classes[class].lock);
+    stats->size = size_classes[class].size;
+    stats->slab_count = size_classes[class].slab_count;
+    stats->used_count = size_classes[class].used_count;
+    stats->capacity = size_classes[class].slab_count * size_classes[class].objects_per_slab;
+    spin_unlock_irqrestore(&size_classes[class].lock);
+
+    // read while the caches keep changing, so only a snapshot
+    stats->cached_count = 0;
+    DLIST_LOCK_IRQSAVE(caches);
+    for (struct kmalloc_cache_t *cache = caches.head; cache != NULL; cache = cache->links.next) {
+        stats->cached_count += __atomic_load_n(&cache->magazines[class].count, __ATOMIC_RELAXED)
+            + __atomic_load_n(&cache->remote_free_pending[class], __ATOMIC_RELAXED);
+    }
+    DLIST_UNLOCK_IRQRESTORE(caches);
+}
+
+void kmalloc_get_cache_stats(struct kmalloc_cache_stats_t *stats) {
+    stats->refill_count = 0;
+    stats->drain_count = 0;
+    stats->remote_free_count = 0;
+
+    DLIST_LOCK_IRQSAVE(caches);
+    for (struct kmalloc_cache_t *cache = caches.head; cache != NULL; cache = cache->links.next) {
+        stats->refill_count += __atomic_load_n(&cache->refill_count, __ATOMIC_RELAXED);
+        stats->drain_count += __atomic_load_n(&cache->drain_count, __ATOMIC_RELAXED);
+        stats->remote_free_count += __atomic_load_n(&cache->remote_free_count, __ATOMIC_RELAXED);
+    }
+    DLIST_UNLOCK_IRQRESTORE(caches);
+}
+
+void kmalloc_dump_stats(void) {
+    uint64_t slab_count = 0;
+    for (uint8_t class = 0; class < KMALLOC_CLASS_COUNT; class++) {
+        struct kmalloc_class_stats_t stats;
+        kmalloc_get_class_stats(class, &stats);
+        slab_count += stats.slab_count;
+        if (stats.slab_count == 0) {
+            continue;
+        }
+
+        klog_debug("kmalloc class %4llu B: %4llu slabs, %8llu of %8llu objects used, %4llu of them cached (%llu KiB)",
+                stats.size, stats.slab_count, stats.used_count, stats.capacity, stats.cached_count,
+                stats.used_count * stats.size >> 10);
+    }
+
+    spin_lock_irqsave(&slabs_lock);
+    uint64_t empty_count = empty_slab_count;
+    spin_unlock_irqrestore(&slabs_lock);
+
+    klog_debug("kmalloc slabs: %llu KiB in use by classes, %llu KiB empty",
+            slab_count * SLAB_SIZE >> 10, empty_count * SLAB_SIZE >> 10);
+
+    struct kmalloc_cache_stats_t cache_stats;
+    kmalloc_get_cache_stats(&cache_stats);
+    klog_debug("kmalloc caches: %llu refills, %llu drains, %llu objects freed remotely",
+            cache_stats.refill_count, cache_stats.drain_count, cache_stats.remote_free_count);
+}
+
+// must be called on every CPU before it allocates, with interrupts disabled
+void kmalloc_init_cpu(void) {
+    struct kmalloc_cache_t *cache = &get_cpu()->kmalloc_cache;
+    for (uint8_t class = 0; class < KMALLOC_CLASS_COUNT; class++) {
+        cache->magazines[class].count = 0;
+    }
+    cache->remote_frees = NULL;
+    for (uint8_t class = 0; class < KMALLOC_CLASS_COUNT; class++) {
+        cache->remote_free_pending[class] = 0;
+    }
+    cache->refill_count = 0;
+    cache->drain_count = 0;
+    cache->remote_free_count = 0;
+    DLIST_INSERT_SYNCED(caches, cache, links);
+}
+
+void kmalloc_init(void) {
+    heap_region.start = HEAP_START;
+    heap_region.length = HEAP_SIZE;
+    heap_region.flags = VMM_PAGE_WRITE | VMM_PAGE_NX;
+    heap_region.backing = VMM_BACKING_ZERO;
+    heap_region.owner = PMM_OWNER_HEAP;
+    // the heap is only ever accessed through its mapping
+    heap_region.movable = true;
+    vmm_space_add_region(vmm_get_kernel_space(), &heap_region);
+
     DLIST_INIT(freelist);
 
     struct free_node_t *first = (struct free_node_t *) HEAP_START;
@@ -298,5 +706,29 @@ void kmalloc_init(void) {
     unset_flag(first, FLAG_IS_PREV_FREE);
     freelist_add_node(first);
 
-    klog_info("Kernel heap initialized with %lluMiB of memory", HEAP_SIZE >> 20);
+    slab_region.start = SLABS_START;
+    slab_region.length = SLABS_SIZE;
+    slab_region.flags = VMM_PAGE_WRITE | VMM_PAGE_NX;
+    slab_region.backing = VMM_BACKING_ZERO;
+    slab_region.owner = PMM_OWNER_HEAP;
+    slab_region.movable = true;
+    vmm_space_add_region(vmm_get_kernel_space(), &slab_region);
+
+    DLIST_INIT(empty_slabs);
+    next_fresh_slab = SLABS_START;
+    DLIST_INIT_SYNCED(caches);
+
+    for (uint8_t class = 0; class < KMALLOC_CLASS_COUNT; class++) {
+        size_classes[class].size = CLASS_SIZES[class];
+        size_classes[class].objects_per_slab = (SLAB_SIZE - SLAB_OBJECTS_OFFSET) / CLASS_SIZES[class];
+        size_classes[class].lock = SPINLOCK_INIT;
+        DLIST_INIT(size_classes[class].partial_slabs);
+    }
+
+    bool old_int_state = interrupts_set(false);
+    kmalloc_init_cpu();
+    interrupts_set(old_int_state);
+
+    klog_info("Kernel heap initialized with %lluMiB of address space, %lluMiB more for slabs",
+            HEAP_SIZE >> 20, SLABS_SIZE >> 20);
 }
@@ -1,7 +1,61 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+// allocations of up to 4KiB come from slabs of one of these size classes, see kmalloc.c
+#define KMALLOC_CLASS_COUNT 17
+
+// objects of each class cached per CPU, and how many are moved between a cache and the slabs at once
+#define KMALLOC_MAGAZINE_SIZE 32
+#define KMALLOC_MAGAZINE_BATCH 16
+
+struct kmalloc_magazine_t {
+    uint64_t count;
+    void *objects[KMALLOC_MAGAZINE_SIZE];
+};
+
+struct kmalloc_cache_t {
+    struct kmalloc_magazine_t magazines[KMALLOC_CLASS_COUNT];
+    // objects of slabs this cache owns that were freed on other CPUs, linked through their first word
+    void *remote_frees;
+    // objects of each class on remote_frees, counted ahead of the list while objects are pushed
+    uint64_t remote_free_pending[KMALLOC_CLASS_COUNT];
+    uint64_t refill_count;
+    uint64_t drain_count;
+    uint64_t remote_free_count;
+    struct {
+        struct kmalloc_cache_t *prev;
+        struct kmalloc_cache_t *next;
+    } links;
+};
+
+struct kmalloc_class_stats_t {
+    uint64_t size;
+    uint64_t slab_count;
+    // objects handed out / room for objects in the slabs of the class
+    uint64_t used_count;
+    uint64_t capacity;
+    // of the used objects, those sitting in the per-CPU caches or on their way back to one
+    uint64_t cached_count;
+};
+
+struct kmalloc_cache_stats_t {
+    // batches taken from / given back to the slabs, over all CPUs
+    uint64_t refill_count;
+    uint64_t drain_count;
+    // objects freed on another CPU than the one owning their slab, once taken off the remote free list
+    uint64_t remote_free_count;
+};
 
 void *kmalloc(size_t sz);
+// allocates from the coalescing heap whatever the size, as kmalloc did before the size classes
+// only meant for comparison in benchmarks; the memory is freed with kfree
+void *kmalloc_heap(size_t sz);
 void kmalloc_init(void);
+void kmalloc_init_cpu(void);
 void kfree(void *ptr);
+void kmalloc_get_class_stats(uint8_t class, struct kmalloc_class_stats_t *stats);
+void kmalloc_get_cache_stats(struct kmalloc_cache_stats_t *stats);
+// logs the usage of every size class and the cache stats at the debug level
+void kmalloc_dump_stats(void);
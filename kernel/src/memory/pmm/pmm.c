@@ -1,129 +1,1521 @@
+#include <stddef.h>
+
+#include "acpi/slit.h"
+#include "acpi/srat.h"
+#include "arch/x86_64/asm.h"
+#include "kassert/kassert.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
 #include "lib/align.h"
 #include "lib/bitmap/bitmap.h"
+#include "lib/list/dlist.h"
+#include "lib/memutil.h"
+#include "lib/spinlock/spinlock.h"
 #include "memory/pmm/pmm.h"
 #include "memory/vmm/vmm.h"
+#include "mp/cpu.h"
+#include "mp/mp.h"
+#include "sched/sched.h"
+#include "timer/timer.h"
 
-static struct bitmap_t bitmap;
-static phys_t page_allocation_start;
+// physical memory is managed by a binary buddy allocator
+//
+// a block of order K is 2^K pages long and is naturally aligned,
+// i.e. its first page frame number is a multiple of 2^K
+// the buddy of a block of order K is the other half of the block of order K+1
+// containing it, so its page frame number differs in bit K only
+//
+// every usable memmap entry becomes a zone, with its own buddy allocator
+// every order of every zone has:
+// - a doubly linked list of its free blocks; the list nodes are stored
+//   in the first page of every free block, which is accessed through the HHDM
+// - a bitmap with one bit per block: is this block free *at this order*?
+//   this is what allows finding out in O(1) whether a buddy can be coalesced
+// the bitmaps of a zone are placed in the first pages of the zone itself
+//
+// every zone belongs to a single NUMA node; zones are split where SRAT memory ranges begin or end
+// allocations come from the zones of the local node of the CPU first,
+// then from those of the other nodes, nearest first
+//
+// all zones are protected by a single lock
+// single pages are allocated from and freed to a per-CPU cache first,
+// which only touches the global allocator to move PMM_CACHE_BATCH pages at a time
+//
+// zeroed single pages are taken from a pool of pre-zeroed pages when possible;
+// the pool is refilled by a kernel thread that zeroes one page each time it is scheduled
+//
+// every managed page frame also has a page descriptor (struct page_t), in an array indexed
+// by page frame number; the array is virtually contiguous, but only the parts of it
+// describing managed memory are backed by pages
+// free pages have a reference count of 0; an allocated block has a reference count of 1
+// on its first page, which single pages can have raised by pmm_page_get
+// pages in the per-CPU caches and in the zeroed pool count as free
+//
+// once memory is fragmented, no large block may be left even with plenty of pages free
+// compaction then looks for a naturally aligned range in which every page is either free
+// or movable, moves the movable pages out of it and hands out the whole range
+// a moved page may be in use on any CPU, so all other CPUs are stopped meanwhile
+// it runs when a contiguous allocation fails, and in a kernel thread
+// that keeps a 2MiB block around whenever enough pages are free
 
-void pmm_init(struct limine_memmap_response *memmap) {
-    struct limine_memmap_entry *largest_usable_entry = memmap->entries[0];
+#define PMM_MAX_ZONES 64
+
+// free blocks are linked through their first page
+struct free_block_t {
+    struct {
+        struct free_block_t *prev;
+        struct free_block_t *next;
+    } links;
+};
+
+DLIST_TYPE(free_list_t, struct free_block_t);
+
+struct zone_t {
+    // page frame numbers of the managed range [start_pfn, end_pfn)
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    // page frame number the bitmaps are indexed from
+    // the halves of a split zone keep sharing the bitmaps of the original zone
+    uint64_t base_pfn;
+    uint32_t node;
+    uint64_t free_page_count;
+    uint64_t free_block_counts[PMM_MAX_ORDER + 1];
+    struct free_list_t free_lists[PMM_MAX_ORDER + 1];
+    struct bitmap_t free_bitmaps[PMM_MAX_ORDER + 1];
+};
+
+// zones are sorted by address, like the memmap entries they come from
+static struct zone_t zones[PMM_MAX_ZONES];
+static uint8_t zone_count;
+
+static struct spinlock_t pmm_lock = SPINLOCK_STATIC_INIT;
+// the CPU holding pmm_lock, so that page faults can check they were not taken under it
+static struct cpu_t *pmm_lock_owner;
+
+// free pages in the zones, not counting those held in the per-CPU caches
+static uint64_t free_page_count;
+// all per-CPU caches, for counting the free pages they hold
+static DLIST_HEAD_SYNCED(caches, struct pmm_cache_t);
+static uint64_t usable_page_count;
+static uint64_t metadata_page_count;
+static uint64_t unmanaged_page_count;
+
+// bootloader reclaimable ranges, recorded at init since the memmap itself lives in one of them
+static struct {
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+} reclaimable_ranges[PMM_MAX_ZONES];
+static uint8_t reclaimable_range_count;
+static bool reclaimed;
+
+static struct {
+    struct spinlock_t lock;
+    uint64_t count;
+    phys_t pages[PMM_ZEROED_POOL_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+} zeroed_pool = { .lock = SPINLOCK_STATIC_INIT };
+
+// the pool is only refilled while more than this many pages are free
+static const uint64_t ZEROED_POOL_MIN_FREE_PAGES = 4 * PMM_ZEROED_POOL_SIZE;
+
+// the page descriptors are only maintained once they are mapped, which needs the VMM
+static bool page_array_ready;
+
+// compaction needs the timer and all CPUs to be up
+static bool compaction_enabled;
+static struct pmm_compaction_stats_t compaction_stats;
+
+// the compaction thread tries to keep a block of this order free
+static const uint8_t COMPACTION_ORDER = PMM_ORDER_2M;
+// as long as more than this many pages are free
+static const uint64_t COMPACTION_MIN_FREE_PAGES = 4 * (1ull << PMM_ORDER_2M);
+// checking this often, and half as often after every failed run
+static const uint64_t COMPACTION_INTERVAL_NS = 1000000000;
+static const uint64_t COMPACTION_MAX_INTERVAL_NS = 64000000000;
+
+static const uint64_t COMPACTION_UNMOVABLE = UINT64_MAX;
+
+// ranges probed per hold of pmm_lock while looking for one to compact, and per node and run
+static const uint64_t COMPACTION_SCAN_BATCH = 16;
+static const uint64_t COMPACTION_SCAN_LIMIT = 4096;
+// where the last scan of each node left off, so that capped scans still make their way through the node
+static uint64_t compaction_scan_pfns[NUMA_MAX_NODES];
+
+// used pages tagged with each owner
+static uint64_t owner_page_counts[PMM_OWNER_COUNT];
+
+static const char *OWNER_NAMES[PMM_OWNER_COUNT] = {
+    [PMM_OWNER_NONE] = "untagged",
+    [PMM_OWNER_PAGE_TABLES] = "page tables",
+    [PMM_OWNER_HEAP] = "heap",
+    [PMM_OWNER_STACKS] = "stacks",
+    [PMM_OWNER_DMA] = "DMA",
+    [PMM_OWNER_PAGE_DESCRIPTORS] = "page descriptors",
+    [PMM_OWNER_VMALLOC] = "vmalloc",
+    [PMM_OWNER_USER] = "user"
+};
+
+static uint32_t node_count = 1;
+// for every node, all nodes ordered by their distance to it, starting with the node itself
+static uint32_t node_fallbacks[NUMA_MAX_NODES][NUMA_MAX_NODES];
+// pages allocated from each node for CPUs of that node / of other nodes
+static uint64_t node_local_alloc_counts[NUMA_MAX_NODES];
+static uint64_t node_remote_alloc_counts[NUMA_MAX_NODES];
+
+static inline void lock_pmm(void) {
+    spin_lock(&pmm_lock);
+    pmm_lock_owner = get_cpu();
+}
+
+static inline void unlock_pmm(void) {
+    pmm_lock_owner = NULL;
+    spin_unlock(&pmm_lock);
+}
+
+static inline void lock_pmm_irqsave(void) {
+    spin_lock_irqsave(&pmm_lock);
+    pmm_lock_owner = get_cpu();
+}
+
+static inline void unlock_pmm_irqrestore(void) {
+    pmm_lock_owner = NULL;
+    spin_unlock_irqrestore(&pmm_lock);
+}
+
+static inline uint64_t order_pages(uint8_t order) {
+    return 1ull << order;
+}
+
+static inline struct free_block_t *pfn_to_block(uint64_t pfn) {
+    return (struct free_block_t *) (pfn * PAGE_SIZE + vmm_get_hhdm_offset());
+}
+
+static inline uint64_t block_to_pfn(struct free_block_t *block) {
+    return ((uintptr_t) block - vmm_get_hhdm_offset()) / PAGE_SIZE;
+}
+
+// index of the block of order `order` starting at `pfn` in that order's bitmap
+static inline uint64_t block_index(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    return (pfn >> order) - (zone->base_pfn >> order);
+}
+
+static inline bool block_in_zone(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    return pfn >= zone->start_pfn && pfn + order_pages(order) <= zone->end_pfn;
+}
+
+static inline bool block_is_free(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    return bitmap_get_bit(&zone->free_bitmaps[order], block_index(zone, pfn, order));
+}
+
+static void push_free_block(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    bitmap_set_bit(&zone->free_bitmaps[order], block_index(zone, pfn, order));
+    DLIST_INSERT(zone->free_lists[order], pfn_to_block(pfn), links);
+    zone->free_block_counts[order]++;
+}
+
+static void remove_free_block(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    bitmap_unset_bit(&zone->free_bitmaps[order], block_index(zone, pfn, order));
+    DLIST_DELETE(zone->free_lists[order], pfn_to_block(pfn), links);
+    zone->free_block_counts[order]--;
+}
+
+static uint8_t order_for_pages(uint64_t n_pages) {
+    uint8_t order = 0;
+    while (order_pages(order) < n_pages) {
+        order++;
+    }
+    return order;
+}
+
+static struct zone_t *find_zone(uint64_t pfn) {
+    uint8_t lo = 0;
+    uint8_t hi = zone_count;
+    while (lo < hi) {
+        uint8_t mid = (lo + hi) / 2;
+        struct zone_t *zone = &zones[mid];
+        if (pfn < zone->start_pfn) {
+            hi = mid;
+        } else if (pfn >= zone->end_pfn) {
+            lo = mid + 1;
+        } else {
+            return zone;
+        }
+    }
+
+    kpanic("Page frame %llx is not managed by the PMM", pfn);
+}
+
+// takes a free block of order `block_order` from the zone and splits it down to order `order`
+static uint64_t zone_alloc_block(struct zone_t *zone, uint8_t block_order, uint8_t order) {
+    uint64_t pfn = block_to_pfn(zone->free_lists[block_order].head);
+    remove_free_block(zone, pfn, block_order);
+
+    // split the block until it has the requested order
+    // the upper halves are given back as free blocks of lower orders
+    while (block_order > order) {
+        block_order--;
+        push_free_block(zone, pfn + order_pages(block_order), block_order);
+    }
+
+    zone->free_page_count -= order_pages(order);
+    free_page_count -= order_pages(order);
+
+    return pfn;
+}
+
+static bool try_alloc_block(uint8_t order, uint32_t node, uint64_t *pfn_out) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        uint32_t curr_node = node_fallbacks[node][i];
+
+        // best fit across the zones of the node: only the smallest free block that is large enough is split,
+        // so that small allocations keep breaking up the same few large blocks
+        // instead of eating into the large blocks of every zone, which huge allocations need
+        // among blocks of the same order, zones are tried from the highest addresses down,
+        // keeping low memory available for as long as possible
+        for (uint8_t block_order = order; block_order <= PMM_MAX_ORDER; block_order++) {
+            for (uint8_t j = zone_count; j > 0; j--) {
+                struct zone_t *zone = &zones[j - 1];
+                if (zone->node == curr_node && zone->free_lists[block_order].head != NULL) {
+                    *pfn_out = zone_alloc_block(zone, block_order, order);
+
+                    if (curr_node == node) {
+                        node_local_alloc_counts[curr_node] += order_pages(order);
+                    } else {
+                        node_remote_alloc_counts[curr_node] += order_pages(order);
+                    }
+
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+// must be called with interrupts disabled
+static inline uint32_t local_node(void) {
+    return get_cpu()->numa_node;
+}
+
+static void free_block(struct zone_t *zone, uint64_t pfn, uint8_t order) {
+    kassert(block_in_zone(zone, pfn, order));
+    kassert(!block_is_free(zone, pfn, order));
+
+    zone->free_page_count += order_pages(order);
+    free_page_count += order_pages(order);
+
+    // coalesce with the buddy for as long as the buddy is free as a whole
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy_pfn = pfn ^ order_pages(order);
+        if (!block_in_zone(zone, buddy_pfn, order) || !block_is_free(zone, buddy_pfn, order)) {
+            break;
+        }
+
+        remove_free_block(zone, buddy_pfn, order);
+        pfn &= ~order_pages(order);
+        order++;
+    }
+
+    push_free_block(zone, pfn, order);
+}
+
+// frees an arbitrary range of pages as the largest naturally aligned blocks that fit
+static void free_range(struct zone_t *zone, uint64_t pfn, uint64_t n_pages) {
+    while (n_pages > 0) {
+        uint8_t order = 0;
+        while (order < PMM_MAX_ORDER
+            && (pfn & order_pages(order)) == 0
+            && order_pages(order + 1) <= n_pages) {
+            order++;
+        }
+
+        free_block(zone, pfn, order);
+        pfn += order_pages(order);
+        n_pages -= order_pages(order);
+    }
+}
+
+static void zero_pages(phys_t addr, uint64_t n_pages) {
+    rep_stosq((void *) (addr + vmm_get_hhdm_offset()), 0, n_pages * PAGE_SIZE / sizeof(uint64_t));
+}
+
+static void set_page_allocated(uint64_t pfn, uint8_t order) {
+    struct page_t *page = pmm_pfn_to_page(pfn);
+    page->refcount = 1;
+    page->flags = 0;
+    page->order = order;
+    page->owner = 0;
+}
+
+// drops the owner tag of an allocation of `n_pages` starting at `pfn`
+static void clear_owner(uint64_t pfn, uint64_t n_pages) {
+    struct page_t *page = pmm_pfn_to_page(pfn);
+    if (page->owner != PMM_OWNER_NONE) {
+        __atomic_fetch_sub(&owner_page_counts[page->owner], n_pages, __ATOMIC_RELAXED);
+        page->owner = PMM_OWNER_NONE;
+    }
+}
+
+static void set_page_free(uint64_t pfn, uint64_t n_pages) {
+    struct page_t *page = pmm_pfn_to_page(pfn);
+    kassert(page->refcount == 1);
+    kassert((page->flags & PAGE_FLAG_RESERVED) == 0);
+    clear_owner(pfn, n_pages);
+    page->refcount = 0;
+}
+
+// resets the descriptors of [start_pfn, end_pfn)
+static void init_page_range(uint64_t start_pfn, uint64_t end_pfn, uint32_t refcount, uint16_t flags, uint32_t node) {
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; pfn++) {
+        struct page_t *page = pmm_pfn_to_page(pfn);
+        page->refcount = refcount;
+        page->flags = flags;
+        page->order = 0;
+        page->node = node;
+        page->owner = 0;
+        page->virt_page = 0;
+        page->links.prev = NULL;
+        page->links.next = NULL;
+    }
+}
+
+// backs the descriptors of [start_pfn, end_pfn) with zeroed pages where they are not yet
+// this allocates, so it must not be called with pmm_lock held
+static void map_page_range(uint64_t start_pfn, uint64_t end_pfn) {
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    uintptr_t virt_start = align_down((uintptr_t) pmm_pfn_to_page(start_pfn), PAGE_SIZE);
+    uintptr_t virt_end = (uintptr_t) pmm_pfn_to_page(end_pfn);
+
+    for (uintptr_t virt = virt_start; virt < virt_end; virt += PAGE_SIZE) {
+        if (vmm_walk_page_cached(pagemap, virt) == 0) {
+            phys_t page_addr = pmm_alloc(true);
+            vmm_map_page(pagemap, virt, page_addr, VMM_PAGE_WRITE | VMM_PAGE_NX);
+            pmm_set_owner(page_addr, 1, PMM_OWNER_PAGE_DESCRIPTORS);
+        }
+    }
+}
+
+// tags the pages backing the descriptors of [start_pfn, end_pfn), which were mapped before they could be
+static void tag_page_range(uint64_t start_pfn, uint64_t end_pfn) {
+    phys_t pagemap = vmm_get_kernel_pagemap();
+    uintptr_t virt_start = align_down((uintptr_t) pmm_pfn_to_page(start_pfn), PAGE_SIZE);
+    uintptr_t virt_end = (uintptr_t) pmm_pfn_to_page(end_pfn);
+
+    for (uintptr_t virt = virt_start; virt < virt_end; virt += PAGE_SIZE) {
+        phys_t page_addr = vmm_walk_page_cached(pagemap, virt);
+        // pages shared by the descriptors of two zones are visited twice
+        if (pmm_phys_to_page(page_addr)->owner == PMM_OWNER_NONE) {
+            pmm_set_owner(page_addr, 1, PMM_OWNER_PAGE_DESCRIPTORS);
+        }
+    }
+}
+
+static void add_zone(uint64_t region_start_pfn, uint64_t region_end_pfn) {
+    uint64_t region_pages = region_end_pfn - region_start_pfn;
+
+    if (zone_count == PMM_MAX_ZONES) {
+        klog_warn("PMM: Exceeded max zone count, leaving %llu KiB unmanaged", region_pages * PAGE_SIZE >> 10);
+        unmanaged_page_count += region_pages;
+        return;
+    }
+
+    struct zone_t new_zone;
+    struct zone_t *zone = &new_zone;
+    zone->start_pfn = region_start_pfn;
+    zone->end_pfn = region_end_pfn;
+    zone->base_pfn = region_start_pfn;
+    zone->node = 0;
+
+    // the bitmaps are placed at the start of the region
+    // each one is large enough for the whole region
+    uint64_t block_counts[PMM_MAX_ORDER + 1];
+    uint64_t total_bitmap_words = 0;
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        block_counts[order] = block_index(zone, region_end_pfn - 1, order) + 1;
+        total_bitmap_words += bitmap_word_count(block_counts[order]);
+    }
+
+    uint64_t pages_used_to_store_bitmaps = div_and_align_up(total_bitmap_words * sizeof(uint64_t), PAGE_SIZE);
+
+    // a region that cannot hold its own metadata and at least one page is not worth managing
+    if (pages_used_to_store_bitmaps >= region_pages) {
+        unmanaged_page_count += region_pages;
+        return;
+    }
+
+    // the buddy bitmaps are only ever probed bit by bit, so they need no summary
+    uint64_t *curr_bitmap = (uint64_t *) (region_start_pfn * PAGE_SIZE + vmm_get_hhdm_offset());
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        bitmap_init(&zone->free_bitmaps[order], curr_bitmap, NULL, block_counts[order]);
+        curr_bitmap += bitmap_word_count(block_counts[order]);
+
+        DLIST_INIT(zone->free_lists[order]);
+        zone->free_block_counts[order] = 0;
+    }
+
+    // start allocating physical memory after the bitmaps
+    zone->start_pfn = region_start_pfn + pages_used_to_store_bitmaps;
+    zone->free_page_count = 0;
+    metadata_page_count += pages_used_to_store_bitmaps;
+
+    // keep the zones sorted by address, since zones added late may lie between existing ones
+    // moving a zone is fine: nothing points back at it, not even its free lists
+    uint8_t index = zone_count;
+    while (index > 0 && zones[index - 1].start_pfn > region_start_pfn) {
+        zones[index] = zones[index - 1];
+        index--;
+    }
+
+    zones[index] = new_zone;
+    zone_count++;
+
+    zone = &zones[index];
+
+    if (page_array_ready) {
+        init_page_range(zone->base_pfn, zone->start_pfn, 1, PAGE_FLAG_RESERVED, zone->node);
+        init_page_range(zone->start_pfn, zone->end_pfn, 0, 0, zone->node);
+    }
+
+    free_range(zone, zone->start_pfn, zone->end_pfn - zone->start_pfn);
+}
 
+// splits the zone at `index` in two at `split_pfn`, which must lie inside of it
+static void split_zone(uint8_t index, uint64_t split_pfn) {
+    if (zone_count == PMM_MAX_ZONES) {
+        klog_warn("PMM: Exceeded max zone count, not splitting zone at %016llx", split_pfn * PAGE_SIZE);
+        return;
+    }
+
+    for (uint8_t i = zone_count; i > index + 1; i--) {
+        zones[i] = zones[i - 1];
+    }
+    zone_count++;
+
+    struct zone_t *lower = &zones[index];
+    struct zone_t *upper = &zones[index + 1];
+
+    // break up the free blocks straddling the split, largest first
+    // the half that still straddles it is broken up again at the next lower order
+    for (uint8_t order = PMM_MAX_ORDER; order > 0; order--) {
+        uint64_t pfn = split_pfn & ~(order_pages(order) - 1);
+        if (pfn != split_pfn && block_in_zone(lower, pfn, order) && block_is_free(lower, pfn, order)) {
+            remove_free_block(lower, pfn, order);
+            push_free_block(lower, pfn, order - 1);
+            push_free_block(lower, pfn + order_pages(order - 1), order - 1);
+        }
+    }
+
+    *upper = *lower;
+    upper->start_pfn = split_pfn;
+    upper->free_page_count = 0;
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        DLIST_INIT(upper->free_lists[order]);
+        upper->free_block_counts[order] = 0;
+    }
+    lower->end_pfn = split_pfn;
+
+    // the free blocks above the split move over, their bits stay where they are in the shared bitmaps
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        struct free_block_t *block = lower->free_lists[order].head;
+        while (block != NULL) {
+            struct free_block_t *next = block->links.next;
+
+            if (block_to_pfn(block) >= split_pfn) {
+                DLIST_DELETE(lower->free_lists[order], block, links);
+                DLIST_INSERT(upper->free_lists[order], block, links);
+                lower->free_page_count -= order_pages(order);
+                upper->free_page_count += order_pages(order);
+                lower->free_block_counts[order]--;
+                upper->free_block_counts[order]++;
+            }
+
+            block = next;
+        }
+    }
+}
+
+static uint32_t node_of_pfn(uint64_t pfn) {
+    struct srat_mem_range_t *ranges = srat_get_mem_ranges();
+    for (uint16_t i = 0; i < srat_get_mem_range_count(); i++) {
+        if (ranges[i].base / PAGE_SIZE <= pfn && pfn < (ranges[i].base + ranges[i].length) / PAGE_SIZE) {
+            return ranges[i].node;
+        }
+    }
+
+    return 0;
+}
+
+// splits the zones spanning the start or end of an SRAT memory range, then assigns every zone its node
+static void apply_numa_layout(void) {
+    struct srat_mem_range_t *ranges = srat_get_mem_ranges();
+    for (uint16_t i = 0; i < srat_get_mem_range_count(); i++) {
+        uint64_t range_bounds[2] = {
+            ranges[i].base / PAGE_SIZE,
+            (ranges[i].base + ranges[i].length) / PAGE_SIZE
+        };
+
+        for (uint8_t j = 0; j < 2; j++) {
+            for (uint8_t k = 0; k < zone_count; k++) {
+                if (zones[k].start_pfn < range_bounds[j] && range_bounds[j] < zones[k].end_pfn) {
+                    split_zone(k, range_bounds[j]);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < zone_count; i++) {
+        zones[i].node = node_of_pfn(zones[i].start_pfn);
+
+        if (page_array_ready) {
+            for (uint64_t pfn = zones[i].start_pfn; pfn < zones[i].end_pfn; pfn++) {
+                pmm_pfn_to_page(pfn)->node = zones[i].node;
+            }
+        }
+    }
+}
+
+static void record_reclaimable_range(uint64_t start_pfn, uint64_t end_pfn) {
+    // adjacent entries are merged, so that they end up in a single zone
+    if (reclaimable_range_count > 0 && reclaimable_ranges[reclaimable_range_count - 1].end_pfn == start_pfn) {
+        reclaimable_ranges[reclaimable_range_count - 1].end_pfn = end_pfn;
+        return;
+    }
+
+    if (reclaimable_range_count == PMM_MAX_ZONES) {
+        klog_warn("PMM: Too many bootloader reclaimable ranges, %llu KiB will not be reclaimed",
+                (end_pfn - start_pfn) * PAGE_SIZE >> 10);
+        return;
+    }
+
+    reclaimable_ranges[reclaimable_range_count].start_pfn = start_pfn;
+    reclaimable_ranges[reclaimable_range_count].end_pfn = end_pfn;
+    reclaimable_range_count++;
+}
+
+void pmm_init(struct limine_memmap_response *memmap) {
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
 
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length > largest_usable_entry->length) {
-            largest_usable_entry = entry;
+        if (entry->type != LIMINE_MEMMAP_USABLE && entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
+            continue;
+        }
+
+        uint64_t entry_start_pfn = div_and_align_up(entry->base, PAGE_SIZE);
+        uint64_t entry_end_pfn = (entry->base + entry->length) / PAGE_SIZE;
+        if (entry_end_pfn <= entry_start_pfn) {
+            continue;
+        }
+
+        if (entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
+            record_reclaimable_range(entry_start_pfn, entry_end_pfn);
+            continue;
         }
+
+        usable_page_count += entry_end_pfn - entry_start_pfn;
+        add_zone(entry_start_pfn, entry_end_pfn);
     }
 
-    uint64_t usable_pages = largest_usable_entry->length / PAGE_SIZE;
-    
-    // how many pages are needed to store the bitmap?
-    // each bit  stores the state of an usable page  |*8
-    // each byte stores the state of  8 usable pages |*PAGE_SIZE
-    // each page stores the state of (8 * PAGE_SIZE) usable pages
-    //   N pages store  the state of    USABLE_PAGES usable pages
-    // N = USABLE_PAGES / (8*PAGE_SIZE) [aligned up!]
-    uint64_t pages_used_to_store_bitmap = div_and_align_up(usable_pages, 8 * PAGE_SIZE);
+    kassert(free_page_count + metadata_page_count + unmanaged_page_count == usable_page_count);
 
-    // start allocating physical memory after the bitmap
-    page_allocation_start
-        = (phys_t) (largest_usable_entry->base + pages_used_to_store_bitmap * PAGE_SIZE);
+    DLIST_INIT_SYNCED(caches);
+    pmm_init_cpu();
 
-    bitmap.start = (uint8_t *) (largest_usable_entry->base + vmm_get_hhdm_offset());
-    bitmap.bit_count = usable_pages - pages_used_to_store_bitmap;
-    for (uint64_t i = 0; i < pages_used_to_store_bitmap * PAGE_SIZE; i++) {
-        bitmap.start[i] = 0;
+    klog_info("PMM initialized with %lluMiB of avl. phys. mem. in %llu %s",
+            (free_page_count * PAGE_SIZE) >> 20, (uint64_t) zone_count, zone_count == 1 ? "zone" : "zones");
+}
+
+void pmm_reclaim_bootloader_memory(void) {
+    kassert(!reclaimed);
+    reclaimed = true;
+
+    // mapping the descriptors allocates pages, so it is done before taking the lock
+    if (page_array_ready) {
+        for (uint8_t i = 0; i < reclaimable_range_count; i++) {
+            map_page_range(reclaimable_ranges[i].start_pfn, reclaimable_ranges[i].end_pfn);
+        }
     }
 
-    klog_info("PMM initialized with %lluMiB of avl. phys. mem.", largest_usable_entry->length >> 20);
+    lock_pmm_irqsave();
+
+    uint64_t old_free_page_count = free_page_count;
+    uint64_t reclaimable_page_count = 0;
+    for (uint8_t i = 0; i < reclaimable_range_count; i++) {
+        uint64_t start_pfn = reclaimable_ranges[i].start_pfn;
+        uint64_t end_pfn = reclaimable_ranges[i].end_pfn;
+        reclaimable_page_count += end_pfn - start_pfn;
+        add_zone(start_pfn, end_pfn);
+    }
+    usable_page_count += reclaimable_page_count;
+    apply_numa_layout();
+
+    uint64_t reclaimed_page_count = free_page_count - old_free_page_count;
+
+    unlock_pmm_irqrestore();
+
+    klog_info("PMM reclaimed %llu KiB of bootloader memory (%llu KiB usable), now %llu %s",
+            reclaimable_page_count * PAGE_SIZE >> 10, reclaimed_page_count * PAGE_SIZE >> 10,
+            (uint64_t) zone_count, zone_count == 1 ? "zone" : "zones");
 }
 
-phys_t pmm_alloc(bool zero_contents) {
-    uint64_t page_index = 0;
-    while (page_index < bitmap.bit_count && bitmap_get_bit(&bitmap, page_index)) {
-        page_index++;
+void pmm_init_numa(void) {
+    node_count = srat_get_node_count();
+
+    // sort the nodes by distance for every node, with the node itself always first
+    for (uint32_t node = 0; node < node_count; node++) {
+        uint32_t *fallbacks = node_fallbacks[node];
+        fallbacks[0] = node;
+        uint32_t fallback_count = 1;
+
+        for (uint32_t other = 0; other < node_count; other++) {
+            if (other == node) {
+                continue;
+            }
+
+            uint32_t i = fallback_count++;
+            while (i > 1 && slit_get_distance(node, fallbacks[i - 1]) > slit_get_distance(node, other)) {
+                fallbacks[i] = fallbacks[i - 1];
+                i--;
+            }
+            fallbacks[i] = other;
+        }
+    }
+
+    lock_pmm_irqsave();
+    apply_numa_layout();
+    unlock_pmm_irqrestore();
+
+    for (uint32_t node = 0; node < node_count; node++) {
+        struct pmm_node_stats_t stats;
+        pmm_get_node_stats(node, &stats);
+        klog_info("PMM NUMA node %llu: %llu MiB free", (uint64_t) node, stats.free_page_count * PAGE_SIZE >> 20);
+    }
+}
+
+void pmm_init_pages(void) {
+    kassert(!page_array_ready);
+
+    for (uint8_t i = 0; i < zone_count; i++) {
+        map_page_range(zones[i].base_pfn, zones[i].end_pfn);
+    }
+
+    lock_pmm_irqsave();
+
+    // everything starts out allocated, then the free blocks and cached pages are marked as free
+    // the zones cannot have been split yet, so the metadata of every zone lies right before it
+    for (uint8_t i = 0; i < zone_count; i++) {
+        struct zone_t *zone = &zones[i];
+        init_page_range(zone->base_pfn, zone->start_pfn, 1, PAGE_FLAG_RESERVED, zone->node);
+        init_page_range(zone->start_pfn, zone->end_pfn, 1, 0, zone->node);
+
+        for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            for (struct free_block_t *block = zone->free_lists[order].head; block != NULL; block = block->links.next) {
+                uint64_t pfn = block_to_pfn(block);
+                for (uint64_t j = 0; j < order_pages(order); j++) {
+                    pmm_pfn_to_page(pfn + j)->refcount = 0;
+                }
+            }
+        }
+    }
+
+    DLIST_LOCK_IRQSAVE(caches);
+    for (struct pmm_cache_t *cache = caches.head; cache != NULL; cache = cache->links.next) {
+        for (uint64_t i = 0; i < cache->count; i++) {
+            pmm_phys_to_page(cache->pages[i])->refcount = 0;
+        }
+    }
+    DLIST_UNLOCK_IRQRESTORE(caches);
+
+    page_array_ready = true;
+
+    unlock_pmm_irqrestore();
+
+    for (uint8_t i = 0; i < zone_count; i++) {
+        tag_page_range(zones[i].base_pfn, zones[i].end_pfn);
+    }
+
+    klog_info("PMM page descriptors initialized, %llu bytes each", (uint64_t) sizeof(struct page_t));
+}
+
+// must be called on every CPU before it allocates pages, with interrupts disabled
+void pmm_init_cpu(void) {
+    struct pmm_cache_t *cache = &get_cpu()->pmm_cache;
+    cache->count = 0;
+    DLIST_INSERT_SYNCED(caches, cache, links);
+}
+
+static bool zeroed_pool_pop(phys_t *page_addr) {
+    bool popped = false;
+
+    spin_lock_irqsave(&zeroed_pool.lock);
+
+    if (zeroed_pool.count > 0) {
+        *page_addr = zeroed_pool.pages[--zeroed_pool.count];
+        popped = true;
+    }
+
+    spin_unlock_irqrestore(&zeroed_pool.lock);
+
+    return popped;
+}
+
+// both must be called with interrupts disabled
+static void cache_refill(struct pmm_cache_t *cache) {
+    lock_pmm();
+
+    while (cache->count < PMM_CACHE_BATCH) {
+        uint64_t pfn;
+        if (!try_alloc_block(0, local_node(), &pfn)) {
+            break;
+        }
+
+        cache->pages[cache->count++] = pfn * PAGE_SIZE;
+    }
+
+    unlock_pmm();
+
+    // pages sitting in the zeroed pool are still free memory
+    if (cache->count == 0 && zeroed_pool_pop(&cache->pages[0])) {
+        cache->count = 1;
     }
 
-    if (page_index == bitmap.bit_count) {
+    if (cache->count == 0) {
         kpanic("Out of memory");
-    } else {
-        bitmap_set_bit(&bitmap, page_index);
+    }
+}
 
-        phys_t page_addr = page_allocation_start + page_index * PAGE_SIZE;
+static void cache_drain(struct pmm_cache_t *cache) {
+    lock_pmm();
 
-        if (!zero_contents) {
-            return page_addr;
+    for (uint64_t i = 0; i < PMM_CACHE_BATCH; i++) {
+        uint64_t pfn = cache->pages[--cache->count] / PAGE_SIZE;
+        free_block(find_zone(pfn), pfn, 0);
+    }
+
+    unlock_pmm();
+}
+
+// both must be called with the zeroed pool lock and pmm_lock held
+static void release_zeroed_pool(void) {
+    while (zeroed_pool.count > 0) {
+        uint64_t pfn = zeroed_pool.pages[--zeroed_pool.count] / PAGE_SIZE;
+        free_block(find_zone(pfn), pfn, 0);
+    }
+}
+
+static void release_cache(struct pmm_cache_t *cache) {
+    while (cache->count > 0) {
+        uint64_t pfn = cache->pages[--cache->count] / PAGE_SIZE;
+        free_block(find_zone(pfn), pfn, 0);
+    }
+}
+
+// gives the single pages parked in the zeroed pool and in this CPU's cache back to the zones,
+// since any one of them can keep a large block from coalescing
+static void release_parked_pages(void) {
+    spin_lock_irqsave(&zeroed_pool.lock);
+    lock_pmm();
+
+    release_zeroed_pool();
+    release_cache(&get_cpu()->pmm_cache);
+
+    unlock_pmm();
+    spin_unlock_irqrestore(&zeroed_pool.lock);
+}
+
+// finds the free block starting at `pfn` and ending at or before `end_pfn`, if there is one
+static bool find_free_block_at(struct zone_t *zone, uint64_t pfn, uint64_t end_pfn, uint8_t *order_out) {
+    for (uint8_t order = PMM_MAX_ORDER + 1; order > 0; order--) {
+        uint8_t block_order = order - 1;
+        if ((pfn & (order_pages(block_order) - 1)) == 0 && pfn + order_pages(block_order) <= end_pfn
+                && block_in_zone(zone, pfn, block_order) && block_is_free(zone, pfn, block_order)) {
+            *order_out = block_order;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline bool page_is_movable(uint64_t pfn) {
+    struct page_t *page = pmm_pfn_to_page(pfn);
+    return (page->flags & PAGE_FLAG_MOVABLE) != 0 && page->refcount == 1;
+}
+
+// how many pages have to be moved for [start_pfn, start_pfn + 2^order) to be free as a whole,
+// or COMPACTION_UNMOVABLE if some page in it cannot be moved
+// with `count_parked`, free pages parked in the per-CPU caches and the zeroed pool are taken to be free,
+// as they will be once released; they cannot be told apart from pages on their way out of a cache,
+// so this is only good as an estimate while other CPUs are running
+static uint64_t count_pages_to_move(struct zone_t *zone, uint64_t start_pfn, uint8_t order, bool count_parked) {
+    uint64_t end_pfn = start_pfn + order_pages(order);
+    uint64_t count = 0;
+
+    uint64_t pfn = start_pfn;
+    while (pfn < end_pfn) {
+        uint8_t free_order;
+        if (find_free_block_at(zone, pfn, end_pfn, &free_order)) {
+            pfn += order_pages(free_order);
+        } else if (count_parked && pmm_pfn_to_page(pfn)->refcount == 0) {
+            pfn++;
+        } else if (page_is_movable(pfn)) {
+            count++;
+            pfn++;
+        } else {
+            return COMPACTION_UNMOVABLE;
         }
+    }
+
+    return count;
+}
 
-        uint8_t *page_start = (uint8_t *) (page_addr + vmm_get_hhdm_offset());
-        uint8_t *page_end = (uint8_t *) (page_start + PAGE_SIZE);
-        for (uint8_t *i = page_start; i < page_end; i++) {
-            *i = 0;
+// finds the first range of 2^order pages at or above `pfn` in a zone of `node`
+// must be called with pmm_lock held
+static bool next_compaction_range(uint32_t node, uint8_t order, uint64_t *pfn, struct zone_t **zone_out) {
+    for (uint8_t i = 0; i < zone_count; i++) {
+        struct zone_t *zone = &zones[i];
+        if (zone->node != node || zone->end_pfn <= *pfn) {
+            continue;
         }
 
-        return page_addr;
+        uint64_t range_pfn = align_up(*pfn > zone->start_pfn ? *pfn : zone->start_pfn, order_pages(order));
+        if (range_pfn + order_pages(order) <= zone->end_pfn) {
+            *pfn = range_pfn;
+            *zone_out = zone;
+            return true;
+        }
     }
+
+    return false;
 }
 
-phys_t pmm_alloc_n(uint64_t n_pages, bool zero_contents) {
-    bool found_n_pages = false;
-    uint64_t page_index = 0;
-    while (page_index < bitmap.bit_count - n_pages + 1) {
-        if (!bitmap_get_bit(&bitmap, page_index)) {
-            found_n_pages = true;
-            
-            for (uint64_t i = page_index; i < page_index + n_pages; i++) {
-                if (bitmap_get_bit(&bitmap, i)) {
-                    found_n_pages = false;
+// picks the range of the nearest node with free or movable pages only that needs the fewest pages moved
+// pmm_lock is only held for COMPACTION_SCAN_BATCH ranges at a time, and each node is scanned for at most
+// COMPACTION_SCAN_LIMIT ranges, carrying on from where its last scan stopped
+// the other CPUs keep running, so the range has to be checked again
+static bool find_compaction_range(uint8_t order, uint32_t node, uint64_t *pfn_out) {
+    for (uint32_t i = 0; i < node_count; i++) {
+        uint32_t curr_node = node_fallbacks[node][i];
+        uint64_t best_count = COMPACTION_UNMOVABLE;
+
+        uint64_t start_pfn = __atomic_load_n(&compaction_scan_pfns[curr_node], __ATOMIC_RELAXED);
+        uint64_t pfn = start_pfn;
+        bool wrapped = false;
+        bool done = false;
+
+        uint64_t range_count = 0;
+        while (!done && range_count < COMPACTION_SCAN_LIMIT) {
+            lock_pmm_irqsave();
+
+            for (uint64_t j = 0; j < COMPACTION_SCAN_BATCH && range_count < COMPACTION_SCAN_LIMIT; j++) {
+                // zones may have been added while the lock was dropped, so they are looked up again
+                struct zone_t *zone;
+                bool found = next_compaction_range(curr_node, order, &pfn, &zone);
+                if (!found && !wrapped) {
+                    wrapped = true;
+                    pfn = 0;
+                    found = next_compaction_range(curr_node, order, &pfn, &zone);
+                }
+
+                if (!found || (wrapped && pfn >= start_pfn)) {
+                    done = true;
+                    break;
+                }
+
+                uint64_t count = count_pages_to_move(zone, pfn, order, true);
+                if (count < best_count) {
+                    best_count = count;
+                    *pfn_out = pfn;
+                }
+
+                pfn += order_pages(order);
+                range_count++;
+
+                // nothing to move is as good as it gets
+                if (count == 0) {
+                    done = true;
                     break;
                 }
             }
 
-            if (found_n_pages) {
-                break;
+            unlock_pmm_irqrestore();
+        }
+
+        __atomic_store_n(&compaction_scan_pfns[curr_node], pfn, __ATOMIC_RELAXED);
+
+        if (best_count != COMPACTION_UNMOVABLE) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// moves a movable page to `new_pfn`, remapping it in the kernel pagemap
+static void migrate_page(uint64_t pfn, uint64_t new_pfn) {
+    struct page_t *page = pmm_pfn_to_page(pfn);
+    struct page_t *new_page = pmm_pfn_to_page(new_pfn);
+
+    uintptr_t hhdm_offset = vmm_get_hhdm_offset();
+    memcpy((void *) (new_pfn * PAGE_SIZE + hhdm_offset), (void *) (pfn * PAGE_SIZE + hhdm_offset), PAGE_SIZE);
+
+    uintptr_t virt = PMM_MOVABLE_START + (uint64_t) page->virt_page * PAGE_SIZE;
+    vmm_remap_page(vmm_get_kernel_pagemap(), virt, new_pfn * PAGE_SIZE);
+
+    new_page->refcount = 1;
+    new_page->flags = page->flags;
+    new_page->order = 0;
+    new_page->owner = page->owner;
+    new_page->virt_page = page->virt_page;
+
+    page->refcount = 0;
+    page->flags = 0;
+}
+
+// must be called with every other CPU stopped and pmm_lock held
+// on success, the range is allocated as a block of order `order`
+static bool compact_range(struct zone_t *zone, uint64_t start_pfn, uint8_t order, uint64_t *migrated_count_out) {
+    uint64_t end_pfn = start_pfn + order_pages(order);
+
+    // take the free blocks in the range out of the zone, so that no page is moved into the range
+    uint64_t pfn = start_pfn;
+    while (pfn < end_pfn) {
+        uint8_t free_order;
+        if (find_free_block_at(zone, pfn, end_pfn, &free_order)) {
+            remove_free_block(zone, pfn, free_order);
+            zone->free_page_count -= order_pages(free_order);
+            free_page_count -= order_pages(free_order);
+            pfn += order_pages(free_order);
+        } else {
+            pfn++;
+        }
+    }
+
+    *migrated_count_out = 0;
+    for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+        if (!page_is_movable(pfn)) {
+            continue;
+        }
+
+        uint64_t new_pfn;
+        if (!try_alloc_block(0, zone->node, &new_pfn)) {
+            // give back what was taken out of the zone and what was moved out already
+            for (uint64_t i = start_pfn; i < end_pfn; i++) {
+                if (pmm_pfn_to_page(i)->refcount == 0) {
+                    free_block(zone, i, 0);
+                }
             }
+            return false;
         }
 
-        page_index++;
+        migrate_page(pfn, new_pfn);
+        (*migrated_count_out)++;
     }
 
-    if (!found_n_pages) {
-        kpanic("Out of memory");
-    } else {
-        for (uint64_t i = page_index; i < page_index + n_pages; i++) {
-            bitmap_set_bit(&bitmap, i);
+    return true;
+}
+
+// must be called with interrupts enabled, since every other CPU has to be stopped
+// on success, a block of order `order` is allocated at `pfn_out`, either compacted or one that the pages
+// released from the caches on the way coalesced into
+static bool compact(uint8_t order, uint64_t *pfn_out) {
+    kassert(interrupts_state());
+
+    if (!compaction_enabled) {
+        return false;
+    }
+
+    uint64_t start_ns = timer_get_ns();
+
+    // scanning the node takes long, so it is done before stopping the other CPUs
+    bool found = find_compaction_range(order, local_node(), pfn_out);
+    if (found) {
+        interrupts_set(false);
+        found = mp_stop_other_cpus();
+        if (!found) {
+            interrupts_set(true);
         }
+    }
+
+    if (!found) {
+        // the pages parked by this CPU may be all that keeps a block from coalescing
+        release_parked_pages();
+
+        lock_pmm_irqsave();
+        bool allocated = try_alloc_block(order, local_node(), pfn_out);
+        uint64_t time_ns = timer_get_ns() - start_ns;
+        compaction_stats.run_count++;
+        compaction_stats.time_ns += time_ns;
+        unlock_pmm_irqrestore();
+
+        klog_debug("PMM compaction found no order %llu block to recover in %llu us", (uint64_t) order, time_ns / 1000);
+        return allocated;
+    }
+
+    spin_lock(&zeroed_pool.lock);
+    lock_pmm();
+
+    // parked pages would get in the way, and no CPU is using its cache now
+    release_zeroed_pool();
+    DLIST_LOCK_IRQSAVE(caches);
+    for (struct pmm_cache_t *cache = caches.head; cache != NULL; cache = cache->links.next) {
+        release_cache(cache);
+    }
+    DLIST_UNLOCK_IRQRESTORE(caches);
+
+    // pages may have been allocated in the range meanwhile, and zones added, which moves them
+    struct zone_t *zone = find_zone(*pfn_out);
+    uint64_t migrated_count = 0;
+    bool compacted = count_pages_to_move(zone, *pfn_out, order, false) != COMPACTION_UNMOVABLE
+        && compact_range(zone, *pfn_out, order, &migrated_count);
+    // failing that, the pages released from the caches may have coalesced into a block elsewhere
+    bool allocated = compacted || try_alloc_block(order, local_node(), pfn_out);
+
+    uint64_t time_ns = timer_get_ns() - start_ns;
+    compaction_stats.run_count++;
+    compaction_stats.migrated_page_count += migrated_count;
+    compaction_stats.time_ns += time_ns;
+    if (compacted) {
+        compaction_stats.success_count++;
+        compaction_stats.recovered_page_count += order_pages(order);
+    }
 
-        phys_t page_addr = page_allocation_start + page_index * PAGE_SIZE;
+    unlock_pmm();
+    spin_unlock(&zeroed_pool.lock);
 
-        if (!zero_contents) {
+    mp_resume_other_cpus();
+    interrupts_set(true);
+
+    if (compacted) {
+        klog_info("PMM compaction recovered a %llu KiB block at %016llx, moving %llu pages in %llu us",
+                order_pages(order) * PAGE_SIZE >> 10, *pfn_out * PAGE_SIZE, migrated_count, time_ns / 1000);
+    } else {
+        klog_debug("PMM compaction found no order %llu block to recover in %llu us%s", (uint64_t) order, time_ns / 1000,
+                allocated ? ", but released parked pages made one" : "");
+    }
+
+    return allocated;
+}
+
+phys_t pmm_alloc(bool zero_contents) {
+    phys_t page_addr;
+
+    if (zero_contents) {
+        if (zeroed_pool_pop(&page_addr)) {
+            __atomic_fetch_add(&zeroed_pool.hits, 1, __ATOMIC_RELAXED);
+            if (page_array_ready) {
+                set_page_allocated(page_addr / PAGE_SIZE, 0);
+            }
             return page_addr;
         }
 
-        uint8_t *page_start = (uint8_t *) (page_addr + vmm_get_hhdm_offset());
-        uint8_t *page_end = (uint8_t *) (page_start + n_pages * PAGE_SIZE);
-        for (uint8_t *i = page_start; i < page_end; i++) {
-            *i = 0;
-        }
+        __atomic_fetch_add(&zeroed_pool.misses, 1, __ATOMIC_RELAXED);
+    }
+
+    bool old_int_state = interrupts_set(false);
+
+    struct pmm_cache_t *cache = &get_cpu()->pmm_cache;
+    if (cache->count == 0) {
+        cache_refill(cache);
+    }
+
+    page_addr = cache->pages[--cache->count];
+
+    interrupts_set(old_int_state);
+
+    if (page_array_ready) {
+        set_page_allocated(page_addr / PAGE_SIZE, 0);
+    }
+
+    if (zero_contents) {
+        zero_pages(page_addr, 1);
+    }
+
+    return page_addr;
+}
+
+phys_t pmm_alloc_n(uint64_t n_pages, bool zero_contents) {
+    kassert(n_pages > 0);
+
+    uint8_t order = order_for_pages(n_pages);
+    if (order > PMM_MAX_ORDER) {
+        kpanic("Cannot allocate %llu contiguous pages", n_pages);
+    }
+
+    uint64_t pfn;
+
+    lock_pmm_irqsave();
+    bool found = try_alloc_block(order, local_node(), &pfn);
+    unlock_pmm_irqrestore();
+
+    if (!found) {
+        release_parked_pages();
+
+        lock_pmm_irqsave();
+        found = try_alloc_block(order, local_node(), &pfn);
+        unlock_pmm_irqrestore();
+    }
 
-        return page_addr;
+    // compaction needs every other CPU to stop, which a caller with interrupts disabled could hold up
+    if (!found && !(interrupts_state() && compact(order, &pfn))) {
+        kpanic("Out of memory");
+    }
+
+    lock_pmm_irqsave();
+
+    // give back the pages past the requested count
+    free_range(find_zone(pfn), pfn + n_pages, order_pages(order) - n_pages);
+
+    unlock_pmm_irqrestore();
+
+    if (page_array_ready) {
+        set_page_allocated(pfn, order);
+    }
+
+    phys_t page_addr = pfn * PAGE_SIZE;
+
+    if (zero_contents) {
+        zero_pages(page_addr, n_pages);
+    }
+
+    return page_addr;
+}
+
+static void cache_free(phys_t addr) {
+    bool old_int_state = interrupts_set(false);
+
+    struct pmm_cache_t *cache = &get_cpu()->pmm_cache;
+    if (cache->count == PMM_CACHE_SIZE) {
+        cache_drain(cache);
     }
+
+    cache->pages[cache->count++] = addr;
+
+    interrupts_set(old_int_state);
 }
 
 void pmm_free(phys_t addr) {
-    uint64_t page_index = (addr - page_allocation_start) / PAGE_SIZE;
-    bitmap_unset_bit(&bitmap, page_index);
+    if (page_array_ready) {
+        set_page_free(addr / PAGE_SIZE, 1);
+    }
+
+    cache_free(addr);
 }
 
 void pmm_free_n(phys_t addr, uint64_t n_pages) {
-    uint64_t page_index = (addr - page_allocation_start) / PAGE_SIZE;
-    for (uint64_t i = page_index; i < page_index + n_pages; i++) {
-        bitmap_unset_bit(&bitmap, i);
+    uint64_t pfn = addr / PAGE_SIZE;
+
+    if (page_array_ready) {
+        set_page_free(pfn, n_pages);
     }
+
+    lock_pmm_irqsave();
+    free_range(find_zone(pfn), pfn, n_pages);
+    unlock_pmm_irqrestore();
+}
+
+phys_t pmm_alloc_huge(uint8_t order, bool zero_contents) {
+    kassert(order <= PMM_MAX_ORDER);
+
+    uint64_t pfn;
+
+    lock_pmm_irqsave();
+    bool found = try_alloc_block(order, local_node(), &pfn);
+    unlock_pmm_irqrestore();
+
+    if (!found) {
+        release_parked_pages();
+
+        lock_pmm_irqsave();
+        found = try_alloc_block(order, local_node(), &pfn);
+        unlock_pmm_irqrestore();
+
+        if (!found && !(interrupts_state() && compact(order, &pfn))) {
+            return 0;
+        }
+    }
+
+    if (page_array_ready) {
+        set_page_allocated(pfn, order);
+    }
+
+    phys_t addr = pfn * PAGE_SIZE;
+
+    if (zero_contents) {
+        zero_pages(addr, order_pages(order));
+    }
+
+    return addr;
+}
+
+void pmm_free_huge(phys_t addr, uint8_t order) {
+    uint64_t pfn = addr / PAGE_SIZE;
+    kassert(order <= PMM_MAX_ORDER);
+    kassert((pfn & (order_pages(order) - 1)) == 0);
+
+    if (page_array_ready) {
+        kassert(pmm_pfn_to_page(pfn)->order == order);
+        set_page_free(pfn, order_pages(order));
+    }
+
+    lock_pmm_irqsave();
+    free_block(find_zone(pfn), pfn, order);
+    unlock_pmm_irqrestore();
+}
+
+void pmm_mark_movable(phys_t addr, uintptr_t virt) {
+    kassert(page_array_ready);
+    kassert(virt >= PMM_MOVABLE_START);
+
+    struct page_t *page = pmm_phys_to_page(addr);
+    kassert(page->refcount == 1);
+    page->flags |= PAGE_FLAG_MOVABLE;
+    page->virt_page = (virt - PMM_MOVABLE_START) / PAGE_SIZE;
+}
+
+void pmm_set_owner(phys_t addr, uint64_t n_pages, enum pmm_owner owner) {
+    if (!page_array_ready) {
+        return;
+    }
+
+    struct page_t *page = pmm_phys_to_page(addr);
+    kassert(page->refcount > 0);
+    kassert(page->owner == PMM_OWNER_NONE);
+
+    page->owner = owner;
+    __atomic_fetch_add(&owner_page_counts[owner], n_pages, __ATOMIC_RELAXED);
+}
+
+void pmm_page_get(phys_t addr) {
+    kassert(page_array_ready);
+
+    struct page_t *page = pmm_phys_to_page(addr);
+    uint32_t old_refcount = __atomic_fetch_add(&page->refcount, 1, __ATOMIC_RELAXED);
+    kassert(old_refcount > 0);
+}
+
+void pmm_page_put(phys_t addr) {
+    kassert(page_array_ready);
+
+    struct page_t *page = pmm_phys_to_page(addr);
+    uint32_t old_refcount = __atomic_fetch_sub(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    kassert(old_refcount > 0);
+
+    if (old_refcount == 1) {
+        clear_owner(addr / PAGE_SIZE, 1);
+        cache_free(addr);
+    }
+}
+
+static uint64_t get_parked_page_count(void) {
+    uint64_t count = 0;
+
+    DLIST_LOCK_IRQSAVE(caches);
+    for (struct pmm_cache_t *cache = caches.head; cache != NULL; cache = cache->links.next) {
+        count += __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+    }
+    DLIST_UNLOCK_IRQRESTORE(caches);
+
+    count += __atomic_load_n(&zeroed_pool.count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+uint64_t pmm_get_free_page_count(void) {
+    return __atomic_load_n(&free_page_count, __ATOMIC_RELAXED) + get_parked_page_count();
+}
+
+void pmm_get_stats(struct pmm_stats_t *stats) {
+    stats->parked_page_count = get_parked_page_count();
+
+    lock_pmm_irqsave();
+
+    stats->total_page_count = 0;
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        stats->free_block_counts[order] = 0;
+    }
+
+    for (uint8_t i = 0; i < zone_count; i++) {
+        stats->total_page_count += zones[i].end_pfn - zones[i].start_pfn;
+        for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            stats->free_block_counts[order] += zones[i].free_block_counts[order];
+        }
+    }
+
+    stats->free_page_count = free_page_count + stats->parked_page_count;
+    stats->used_page_count = stats->total_page_count - stats->free_page_count;
+    stats->metadata_page_count = metadata_page_count;
+    stats->unmanaged_page_count = unmanaged_page_count;
+
+    unlock_pmm_irqrestore();
+
+    // untagged pages are whatever is used, but not tagged
+    stats->owner_page_counts[PMM_OWNER_NONE] = stats->used_page_count;
+    for (uint8_t owner = PMM_OWNER_NONE + 1; owner < PMM_OWNER_COUNT; owner++) {
+        stats->owner_page_counts[owner] = __atomic_load_n(&owner_page_counts[owner], __ATOMIC_RELAXED);
+        stats->owner_page_counts[PMM_OWNER_NONE] -= stats->owner_page_counts[owner];
+    }
+}
+
+uint8_t pmm_get_zone_count(void) {
+    return zone_count;
+}
+
+void pmm_get_zone_stats(uint8_t zone_index, struct pmm_zone_stats_t *stats) {
+    lock_pmm_irqsave();
+
+    kassert(zone_index < zone_count);
+    struct zone_t *zone = &zones[zone_index];
+
+    stats->start = zone->start_pfn * PAGE_SIZE;
+    stats->end = zone->end_pfn * PAGE_SIZE;
+    stats->node = zone->node;
+    stats->total_page_count = zone->end_pfn - zone->start_pfn;
+    stats->free_page_count = zone->free_page_count;
+    stats->used_page_count = stats->total_page_count - stats->free_page_count;
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        stats->free_block_counts[order] = zone->free_block_counts[order];
+    }
+
+    unlock_pmm_irqrestore();
+}
+
+uint32_t pmm_get_node_count(void) {
+    return node_count;
+}
+
+void pmm_get_node_stats(uint32_t node, struct pmm_node_stats_t *stats) {
+    kassert(node < node_count);
+
+    lock_pmm_irqsave();
+
+    stats->free_page_count = 0;
+    for (uint8_t i = 0; i < zone_count; i++) {
+        if (zones[i].node == node) {
+            stats->free_page_count += zones[i].free_page_count;
+        }
+    }
+    stats->local_alloc_count = node_local_alloc_counts[node];
+    stats->remote_alloc_count = node_remote_alloc_counts[node];
+
+    unlock_pmm_irqrestore();
+}
+
+void pmm_get_zeroed_pool_stats(struct pmm_zeroed_pool_stats_t *stats) {
+    stats->page_count = __atomic_load_n(&zeroed_pool.count, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&zeroed_pool.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&zeroed_pool.misses, __ATOMIC_RELAXED);
+}
+
+static void *worker_zero_pages(void *arg) {
+    (void) arg;
+
+    while (1) {
+        if (__atomic_load_n(&zeroed_pool.count, __ATOMIC_RELAXED) < PMM_ZEROED_POOL_SIZE
+                && pmm_get_free_page_count() > ZEROED_POOL_MIN_FREE_PAGES) {
+            phys_t page_addr = pmm_alloc(false);
+            zero_pages(page_addr, 1);
+
+            spin_lock_irqsave(&zeroed_pool.lock);
+
+            bool pushed = zeroed_pool.count < PMM_ZEROED_POOL_SIZE;
+            if (pushed) {
+                // pages in the pool count as free
+                if (page_array_ready) {
+                    set_page_free(page_addr / PAGE_SIZE, 1);
+                }
+                zeroed_pool.pages[zeroed_pool.count++] = page_addr;
+            }
+
+            spin_unlock_irqrestore(&zeroed_pool.lock);
+
+            if (!pushed) {
+                pmm_free(page_addr);
+            }
+        }
+
+        // one page per turn, so that the pool is mostly filled while CPUs have nothing else to do
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+void pmm_init_zeroed_pool(void) {
+    sched_new_kthread(worker_zero_pages, NULL);
+}
+
+// whether no zone has a free block of COMPACTION_ORDER left, although there are enough free pages for one
+static bool needs_compaction(void) {
+    bool needed = true;
+
+    lock_pmm_irqsave();
+
+    if (free_page_count <= COMPACTION_MIN_FREE_PAGES) {
+        needed = false;
+    }
+
+    for (uint8_t i = 0; i < zone_count && needed; i++) {
+        for (uint8_t order = COMPACTION_ORDER; order <= PMM_MAX_ORDER; order++) {
+            if (zones[i].free_lists[order].head != NULL) {
+                needed = false;
+                break;
+            }
+        }
+    }
+
+    unlock_pmm_irqrestore();
+
+    return needed;
+}
+
+static void *worker_compact(void *arg) {
+    (void) arg;
+
+    uint64_t interval_ns = COMPACTION_INTERVAL_NS;
+    uint64_t last_check_ns = timer_get_ns();
+
+    while (1) {
+        if (timer_get_ns() - last_check_ns >= interval_ns) {
+            if (needs_compaction()) {
+                uint64_t pfn;
+                if (compact(COMPACTION_ORDER, &pfn)) {
+                    // the recovered block goes back to the zone, for whoever needs it next
+                    lock_pmm_irqsave();
+                    free_block(find_zone(pfn), pfn, COMPACTION_ORDER);
+                    unlock_pmm_irqrestore();
+
+                    interval_ns = COMPACTION_INTERVAL_NS;
+                } else if (interval_ns < COMPACTION_MAX_INTERVAL_NS) {
+                    // stopping every CPU for nothing is not worth it, so back off
+                    interval_ns *= 2;
+                }
+            }
+
+            last_check_ns = timer_get_ns();
+        }
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+void pmm_init_compaction(void) {
+    compaction_enabled = true;
+    sched_new_kthread(worker_compact, NULL);
+}
+
+bool pmm_lock_held(void) {
+    return pmm_lock_owner != NULL && pmm_lock_owner == get_cpu();
+}
+
+void pmm_get_compaction_stats(struct pmm_compaction_stats_t *stats) {
+    lock_pmm_irqsave();
+    *stats = compaction_stats;
+    unlock_pmm_irqrestore();
 }
 
 static char *get_entry_type(uint64_t entry_type) {
@@ -159,4 +1551,55 @@ void pmm_print_memmap(struct limine_memmap_response *memmap) {
         char *type = get_entry_type(entry->type);
         klog_debug("%016llx - %016llx %5llu MiB %s", start, end, length_in_mib, type);
     }
+
+    klog_debug("Usable memory: %llu KiB", usable_page_count * PAGE_SIZE >> 10);
+    klog_debug("- managed by the PMM: %llu KiB in %llu %s (%llu KiB of zone metadata)",
+            (usable_page_count - unmanaged_page_count) * PAGE_SIZE >> 10,
+            (uint64_t) zone_count, zone_count == 1 ? "zone" : "zones",
+            metadata_page_count * PAGE_SIZE >> 10);
+    klog_debug("- unmanaged: %llu KiB", unmanaged_page_count * PAGE_SIZE >> 10);
+
+    for (uint64_t i = 0; i < zone_count; i++) {
+        struct zone_t *zone = &zones[i];
+        klog_debug("PMM zone %llu: %016llx - %016llx node %llu %8llu free pages, %llu free max-order blocks", i,
+                zone->start_pfn * PAGE_SIZE, zone->end_pfn * PAGE_SIZE, (uint64_t) zone->node, zone->free_page_count,
+                zone->free_block_counts[PMM_MAX_ORDER]);
+    }
+}
+
+void pmm_dump_stats(void) {
+    struct pmm_stats_t stats;
+    pmm_get_stats(&stats);
+
+    klog_debug("PMM stats: %llu KiB managed, %llu KiB used, %llu KiB free (%llu KiB parked in caches)",
+            stats.total_page_count * PAGE_SIZE >> 10, stats.used_page_count * PAGE_SIZE >> 10,
+            stats.free_page_count * PAGE_SIZE >> 10, stats.parked_page_count * PAGE_SIZE >> 10);
+    klog_debug("PMM stats: %llu KiB of zone metadata, %llu KiB unmanaged",
+            stats.metadata_page_count * PAGE_SIZE >> 10, stats.unmanaged_page_count * PAGE_SIZE >> 10);
+
+    for (uint8_t owner = 0; owner < PMM_OWNER_COUNT; owner++) {
+        klog_debug("PMM used by %-16s %10llu KiB", OWNER_NAMES[owner], stats.owner_page_counts[owner] * PAGE_SIZE >> 10);
+    }
+
+    // the histogram of free block sizes, empty orders at either end left out
+    uint8_t first_order = 0;
+    while (first_order < PMM_MAX_ORDER && stats.free_block_counts[first_order] == 0) {
+        first_order++;
+    }
+    uint8_t last_order = PMM_MAX_ORDER;
+    while (last_order > first_order && stats.free_block_counts[last_order] == 0) {
+        last_order--;
+    }
+    for (uint8_t order = first_order; order <= last_order; order++) {
+        klog_debug("PMM free blocks of %8llu KiB: %8llu (%llu KiB)", order_pages(order) * PAGE_SIZE >> 10,
+                stats.free_block_counts[order], stats.free_block_counts[order] * order_pages(order) * PAGE_SIZE >> 10);
+    }
+
+    for (uint8_t i = 0; i < pmm_get_zone_count(); i++) {
+        struct pmm_zone_stats_t zone_stats;
+        pmm_get_zone_stats(i, &zone_stats);
+        klog_debug("PMM zone %llu: %016llx - %016llx node %llu %8llu pages, %8llu used, %8llu free",
+                (uint64_t) i, zone_stats.start, zone_stats.end, (uint64_t) zone_stats.node,
+                zone_stats.total_page_count, zone_stats.used_page_count, zone_stats.free_page_count);
+    }
 }
@@ -1,17 +1,204 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "lib/spinlock/spinlock.h"
 #include "limine.h"
 
 #define PAGE_SIZE 4096
 
+// blocks of up to 2^PMM_MAX_ORDER pages (1GiB) are handed out by the buddy allocator
+#define PMM_MAX_ORDER 18
+
+// orders of the blocks backing large pages
+#define PMM_ORDER_2M 9
+#define PMM_ORDER_1G 18
+
+// size of the per-CPU page caches, and how many pages are moved
+// between a cache and the global allocator at once
+#define PMM_CACHE_SIZE 64
+#define PMM_CACHE_BATCH 32
+
+// number of pre-zeroed pages kept around for pmm_alloc(true)
+#define PMM_ZEROED_POOL_SIZE 256
+
+// the page descriptor array is mapped here, only where it covers managed memory
+#define PMM_PAGE_ARRAY_START 0xffffc00000000000
+
+// movable pages must be mapped above this address, in the last 16TiB of the address space
+#define PMM_MOVABLE_START 0xfffff00000000000
+
 typedef uint64_t phys_t;
 
+// what allocated pages are used for, for accounting
+enum pmm_owner {
+    PMM_OWNER_NONE,
+    PMM_OWNER_PAGE_TABLES,
+    PMM_OWNER_HEAP,
+    PMM_OWNER_STACKS,
+    PMM_OWNER_DMA,
+    PMM_OWNER_PAGE_DESCRIPTORS,
+    PMM_OWNER_VMALLOC,
+    // anonymous memory of user spaces
+    PMM_OWNER_USER,
+    PMM_OWNER_COUNT
+};
+
+// page descriptor flags
+#define PAGE_FLAG_RESERVED (1 << 0) // holds PMM metadata, never allocated
+#define PAGE_FLAG_MOVABLE (1 << 1) // only accessed through its mapping in the kernel pagemap
+
+// one descriptor per managed page frame, indexed by page frame number
+// for a block of more than one page, only the descriptor of its first page is kept up to date
+struct page_t {
+    // references to an allocated page, 0 for a free one
+    uint32_t refcount;
+    uint16_t flags;
+    // order of the block this page starts, for huge allocations
+    uint8_t order;
+    uint8_t node;
+    // an enum pmm_owner, set through pmm_set_owner
+    uint32_t owner;
+    union {
+        // for movable pages, the page number of their mapping counted from PMM_MOVABLE_START
+        uint32_t virt_page;
+        // for page tables, the number of present entries, kept by the VMM
+        uint32_t entry_count;
+    };
+    // free for use by the owner of the page
+    union {
+        struct {
+            struct page_t *prev;
+            struct page_t *next;
+        } links;
+        // for page tables, taken by the VMM to update their entries
+        // it must not overlap links.next, which unlinked tables are queued for freeing with
+        struct spinlock_t table_lock;
+    };
+};
+
+_Static_assert(sizeof(struct page_t) <= 32, "struct page_t must stay within 32 bytes");
+_Static_assert(offsetof(struct page_t, table_lock) + sizeof(struct spinlock_t) <= offsetof(struct page_t, links.next),
+        "the page table lock must not overlap links.next");
+
+static inline struct page_t *pmm_pfn_to_page(uint64_t pfn) {
+    return &((struct page_t *) PMM_PAGE_ARRAY_START)[pfn];
+}
+
+static inline struct page_t *pmm_phys_to_page(phys_t addr) {
+    return pmm_pfn_to_page(addr / PAGE_SIZE);
+}
+
+static inline uint64_t pmm_page_to_pfn(struct page_t *page) {
+    return page - (struct page_t *) PMM_PAGE_ARRAY_START;
+}
+
+static inline phys_t pmm_page_to_phys(struct page_t *page) {
+    return pmm_page_to_pfn(page) * PAGE_SIZE;
+}
+
+struct pmm_cache_t {
+    uint64_t count;
+    phys_t pages[PMM_CACHE_SIZE];
+    struct {
+        struct pmm_cache_t *prev;
+        struct pmm_cache_t *next;
+    } links;
+};
+
+struct pmm_zeroed_pool_stats_t {
+    uint64_t page_count;
+    // zeroed allocations served from the pool / zeroed inline because the pool was empty
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct pmm_compaction_stats_t {
+    // compaction runs / of them, those that freed up a block
+    uint64_t run_count;
+    uint64_t success_count;
+    uint64_t migrated_page_count;
+    // pages in the blocks freed up
+    uint64_t recovered_page_count;
+    uint64_t time_ns;
+};
+
+struct pmm_stats_t {
+    // pages managed by the PMM, not counting the zone metadata
+    uint64_t total_page_count;
+    uint64_t free_page_count;
+    // free pages sitting in the per-CPU caches and the zeroed pool
+    uint64_t parked_page_count;
+    uint64_t used_page_count;
+    uint64_t metadata_page_count;
+    // usable memory the PMM could not manage
+    uint64_t unmanaged_page_count;
+    // free blocks of every order, over all zones
+    uint64_t free_block_counts[PMM_MAX_ORDER + 1];
+    // used pages by owner; PMM_OWNER_NONE counts those never tagged
+    uint64_t owner_page_counts[PMM_OWNER_COUNT];
+};
+
+struct pmm_zone_stats_t {
+    phys_t start;
+    phys_t end;
+    uint32_t node;
+    uint64_t total_page_count;
+    // free pages in the zone, not counting those parked in the per-CPU caches and the zeroed pool
+    uint64_t free_page_count;
+    uint64_t used_page_count;
+    uint64_t free_block_counts[PMM_MAX_ORDER + 1];
+};
+
+struct pmm_node_stats_t {
+    // free pages in the zones of the node, not counting those held in the per-CPU caches
+    uint64_t free_page_count;
+    // pages allocated from the node for CPUs of the node / of other nodes
+    uint64_t local_alloc_count;
+    uint64_t remote_alloc_count;
+};
+
 void pmm_init(struct limine_memmap_response *memmap);
+// must be called once the SRAT and SLIT are parsed
+void pmm_init_numa(void);
+// sets up the page descriptors, must be called once the VMM is initialized
+void pmm_init_pages(void);
+void pmm_init_cpu(void);
+void pmm_init_zeroed_pool(void);
+void pmm_init_compaction(void);
+// hands the bootloader reclaimable memory to the allocator; this must only be done
+// once nothing uses it anymore: Limine responses, the boot stacks and Limine's page tables
+void pmm_reclaim_bootloader_memory(void);
 phys_t pmm_alloc(bool zero_contents);
 phys_t pmm_alloc_n(uint64_t n_pages, bool zero_contents);
 void pmm_free(phys_t addr);
 void pmm_free_n(phys_t addr, uint64_t n_pages);
+// naturally aligned blocks of 2^order pages, e.g. for large page mappings
+// returns 0 if no such block is free, so that callers can fall back to smaller pages
+phys_t pmm_alloc_huge(uint8_t order, bool zero_contents);
+void pmm_free_huge(phys_t addr, uint8_t order);
+// allows the page to be moved elsewhere by compaction, remapping it at `virt` in the kernel pagemap
+// the page must not be accessed in any other way, e.g. through the HHDM, nor be freed
+void pmm_mark_movable(phys_t addr, uintptr_t virt);
+// tags the allocation of `n_pages` starting at `addr` as being used by `owner`
+// pages allocated before the page descriptors are set up cannot be tagged
+void pmm_set_owner(phys_t addr, uint64_t n_pages, enum pmm_owner owner);
+// takes another reference to an allocated single page
+void pmm_page_get(phys_t addr);
+// drops a reference to a single page, freeing it with the last one
+void pmm_page_put(phys_t addr);
+uint64_t pmm_get_free_page_count(void);
+void pmm_get_stats(struct pmm_stats_t *stats);
+uint8_t pmm_get_zone_count(void);
+void pmm_get_zone_stats(uint8_t zone, struct pmm_zone_stats_t *stats);
+uint32_t pmm_get_node_count(void);
+void pmm_get_node_stats(uint32_t node, struct pmm_node_stats_t *stats);
+void pmm_get_zeroed_pool_stats(struct pmm_zeroed_pool_stats_t *stats);
+void pmm_get_compaction_stats(struct pmm_compaction_stats_t *stats);
+// whether this CPU holds the PMM lock, must be called with interrupts disabled
+bool pmm_lock_held(void);
 void pmm_print_memmap(struct limine_memmap_response *memmap);
+// logs all of the above at the debug level, which goes to debugcon
+void pmm_dump_stats(void);
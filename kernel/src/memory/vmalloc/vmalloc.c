@@ -0,0 +1,259 @@
+#include <stddef.h>
+
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+#include "kpanic/kpanic.h"
+#include "lib/align.h"
+#include "lib/avl/avl.h"
+#include "lib/spinlock/spinlock.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/pmm/pmm.h"
+#include "memory/vmalloc/vmalloc.h"
+#include "memory/vmm/tlb.h"
+#include "memory/vmm/vmm.h"
+
+static const uintptr_t VMALLOC_START = 0xffffd00000000000;
+static const uint64_t VMALLOC_SIZE = 0x10000000000; // 1TiB
+
+// a range of the window, either free or handed out
+struct area_t {
+    uintptr_t start;
+    // including the guard page, if any
+    uint64_t length;
+    bool guard;
+    // maps memory it does not own, through ioremap
+    bool io;
+    // longest free area in the subtree, kept for the free areas only
+    uint64_t max_length;
+    struct avl_node_t tree_node;
+};
+
+// free areas are never adjacent, they are merged when freed
+static struct avl_tree_t free_areas;
+static struct avl_tree_t busy_areas;
+static struct area_t first_area;
+static struct spinlock_t vmalloc_lock = SPINLOCK_STATIC_INIT;
+
+static inline struct area_t *area_of(struct avl_node_t *node) {
+    return node == NULL ? NULL : AVL_ENTRY(node, struct area_t, tree_node);
+}
+
+static int area_cmp(struct avl_node_t *a, struct avl_node_t *b) {
+    uintptr_t a_start = area_of(a)->start;
+    uintptr_t b_start = area_of(b)->start;
+    return a_start < b_start ? -1 : a_start > b_start;
+}
+
+static void update_max_length(struct avl_node_t *node) {
+    struct area_t *area = area_of(node);
+    area->max_length = area->length;
+    if (node->left != NULL && area_of(node->left)->max_length > area->max_length) {
+        area->max_length = area_of(node->left)->max_length;
+    }
+    if (node->right != NULL && area_of(node->right)->max_length > area->max_length) {
+        area->max_length = area_of(node->right)->max_length;
+    }
+}
+
+// the lowest free area of at least `length` bytes, NULL if none
+static struct area_t *find_free_area(uint64_t length) {
+    struct avl_node_t *node = free_areas.root;
+    if (node == NULL || area_of(node)->max_length < length) {
+        return NULL;
+    }
+
+    // the subtree walked into always holds a fitting area
+    while (true) {
+        if (node->left != NULL && area_of(node->left)->max_length >= length) {
+            node = node->left;
+        } else if (area_of(node)->length >= length) {
+            return area_of(node);
+        } else {
+            node = node->right;
+        }
+    }
+}
+
+static struct area_t *find_busy_area(uintptr_t start) {
+    struct avl_node_t *node = busy_areas.root;
+    while (node != NULL && area_of(node)->start != start) {
+        node = start < area_of(node)->start ? node->left : node->right;
+    }
+
+    return area_of(node);
+}
+
+// the free areas right before and right after [start, end), NULL where there is none
+static void find_free_neighbours(uintptr_t start, uintptr_t end, struct area_t **prev, struct area_t **next) {
+    *prev = NULL;
+    *next = NULL;
+
+    struct avl_node_t *node = free_areas.root;
+    while (node != NULL) {
+        struct area_t *area = area_of(node);
+        if (area->start + area->length == start) {
+            *prev = area;
+        } else if (area->start == end) {
+            *next = area;
+        }
+        node = area->start < start ? node->right : node->left;
+    }
+}
+
+// merges `area` into its free neighbours, storing the nodes merged away in `unused`, or NULL
+static void insert_free_area(struct area_t *area, struct area_t *unused[2]) {
+    struct area_t *prev;
+    struct area_t *next;
+    find_free_neighbours(area->start, area->start + area->length, &prev, &next);
+
+    unused[0] = NULL;
+    unused[1] = NULL;
+
+    // the tree keeps the longest area of each subtree, so areas are reinserted once they have grown
+    if (prev != NULL) {
+        avl_remove(&free_areas, &prev->tree_node);
+        prev->length += area->length;
+        unused[0] = area;
+        area = prev;
+    }
+    if (next != NULL) {
+        avl_remove(&free_areas, &next->tree_node);
+        area->length += next->length;
+        unused[1] = next;
+    }
+
+    avl_insert(&free_areas, &area->tree_node);
+}
+
+void vmalloc_init(void) {
+    avl_init(&free_areas, area_cmp, update_max_length);
+    avl_init(&busy_areas, area_cmp, NULL);
+
+    first_area.start = VMALLOC_START;
+    first_area.length = VMALLOC_SIZE;
+    avl_insert(&free_areas, &first_area.tree_node);
+
+    klog_info("vmalloc initialized with %lluGiB of address space", VMALLOC_SIZE >> 30);
+}
+
+// takes `page_count` pages of the window, plus a guard page if `guard` is set
+static struct area_t *reserve_area(uint64_t page_count, bool guard, bool io) {
+    uint64_t length = (page_count + guard) * PAGE_SIZE;
+
+    struct area_t *area = kmalloc(sizeof(struct area_t));
+
+    spin_lock_irqsave(&vmalloc_lock);
+
+    struct area_t *free_area = find_free_area(length);
+    if (free_area == NULL) {
+        kpanic("vmalloc window exhausted, %llu pages requested", page_count);
+    }
+
+    // carved from the front, which keeps the remainder sorted in place
+    avl_remove(&free_areas, &free_area->tree_node);
+    struct area_t *unused = NULL;
+    if (free_area->length == length) {
+        unused = area;
+        area = free_area;
+    } else {
+        area->start = free_area->start;
+        free_area->start += length;
+        free_area->length -= length;
+        avl_insert(&free_areas, &free_area->tree_node);
+    }
+
+    area->length = length;
+    area->guard = guard;
+    area->io = io;
+    avl_insert(&busy_areas, &area->tree_node);
+
+    spin_unlock_irqrestore(&vmalloc_lock);
+
+    if (unused != NULL) {
+        kfree(unused);
+    }
+
+    return area;
+}
+
+// unmaps the area starting at `start`, freeing the pages it mapped unless it is an I/O mapping
+static void release_area(uintptr_t start, bool io) {
+    spin_lock_irqsave(&vmalloc_lock);
+    struct area_t *area = find_busy_area(start);
+    if (area == NULL || area->io != io) {
+        kpanic("%s of 0x%llx, which %s did not return", io ? "iounmap" : "vfree", start, io ? "ioremap" : "vmalloc");
+    }
+    avl_remove(&busy_areas, &area->tree_node);
+    spin_unlock_irqrestore(&vmalloc_lock);
+
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, vmm_get_kernel_pagemap(), start);
+    for (uint64_t i = 0; i < area->length / PAGE_SIZE - area->guard; i++) {
+        phys_t phys = vmm_cursor_unmap(&cursor);
+        kassert(phys != 0);
+        if (!io) {
+            tlb_batch_free_page(&cursor.batch, phys);
+        }
+    }
+    // the range is only reused once no CPU can be caching its old translations
+    vmm_cursor_finish(&cursor);
+
+    struct area_t *unused[2];
+    spin_lock_irqsave(&vmalloc_lock);
+    insert_free_area(area, unused);
+    spin_unlock_irqrestore(&vmalloc_lock);
+
+    for (uint8_t i = 0; i < 2; i++) {
+        // the area the window started out as is not from the heap
+        if (unused[i] != NULL && unused[i] != &first_area) {
+            kfree(unused[i]);
+        }
+    }
+}
+
+static void *ioremap(phys_t phys, size_t sz, uint64_t cache_flags) {
+    kassert(sz != 0);
+
+    phys_t phys_start = align_down(phys, PAGE_SIZE);
+    uint64_t page_count = div_and_align_up(phys + sz - phys_start, PAGE_SIZE);
+    struct area_t *area = reserve_area(page_count, true, true);
+
+    vmm_map_range_contig(vmm_get_kernel_pagemap(), area->start, phys_start, page_count,
+            VMM_PAGE_WRITE | VMM_PAGE_NX | cache_flags);
+
+    return (void *) (area->start + phys - phys_start);
+}
+
+void *vmalloc(size_t sz, uint64_t flags) {
+    kassert(sz != 0);
+
+    uint64_t page_count = div_and_align_up(sz, PAGE_SIZE);
+    struct area_t *area = reserve_area(page_count, flags & VMALLOC_GUARD, false);
+
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, vmm_get_kernel_pagemap(), area->start);
+    for (uint64_t i = 0; i < page_count; i++) {
+        phys_t phys = pmm_alloc(true);
+        pmm_set_owner(phys, 1, PMM_OWNER_VMALLOC);
+        vmm_cursor_map(&cursor, phys, VMM_PAGE_WRITE | VMM_PAGE_NX);
+    }
+    vmm_cursor_finish(&cursor);
+
+    return (void *) area->start;
+}
+
+void vfree(void *ptr) {
+    release_area((uintptr_t) ptr, false);
+}
+
+void *ioremap_uc(phys_t phys, size_t sz) {
+    return ioremap(phys, sz, VMM_PAGE_CACHE_UC);
+}
+
+void *ioremap_wc(phys_t phys, size_t sz) {
+    return ioremap(phys, sz, VMM_PAGE_CACHE_WC);
+}
+
+void iounmap(void *ptr) {
+    release_area(align_down((uintptr_t) ptr, PAGE_SIZE), true);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory/pmm/pmm.h"
+
+// leaves an unmapped page after the allocation, so that overflowing it faults
+#define VMALLOC_GUARD (1 << 0)
+
+// must be called once kmalloc is initialized
+void vmalloc_init(void);
+// maps `sz` bytes, rounded up to whole pages, of zeroed and not necessarily contiguous page frames
+void *vmalloc(size_t sz, uint64_t flags);
+void vfree(void *ptr);
+// map `sz` bytes of MMIO at `phys` uncached or write-combining, followed by a guard page
+// the memory must not be mapped with another type elsewhere, e.g. in the HHDM
+void *ioremap_uc(phys_t phys, size_t sz);
+void *ioremap_wc(phys_t phys, size_t sz);
+void iounmap(void *ptr);
@@ -0,0 +1,372 @@
+#include <stddef.h>
+
+#include "arch/x86_64/asm.h"
+#include "arch/x86_64/idt/idt.h"
+#include "arch/x86_64/interrupts/interrupts.h"
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+#include "kpanic/kpanic.h"
+#include "lib/align.h"
+#include "lib/avl/avl.h"
+#include "lib/bitmap/bitmap.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/vmm/space.h"
+#include "memory/vmm/tlb.h"
+#include "memory/vmm/vmm.h"
+#include "mp/cpu.h"
+
+static const uint8_t PAGE_FAULT_VECTOR = 14;
+// page fault error code bits
+static const uint64_t PF_PRESENT = 1 << 0;
+static const uint64_t PF_WRITE = 1 << 1;
+static const uint64_t PF_USER = 1 << 2;
+static const uint64_t PF_INSTRUCTION_FETCH = 1 << 4;
+
+// page faults are handled on a stack of their own, as the stack that faulted
+// may have just overflowed into its guard page
+static const uint8_t PAGE_FAULT_IST = 1;
+static const uint64_t PAGE_FAULT_STACK_PAGES = 4;
+
+// kernel stacks are handed out in slots, each a guard page followed by the stack
+static const uintptr_t KSTACKS_START = 0xffffe00000000000;
+static const uint64_t KSTACK_SLOT_SIZE = VMM_KSTACK_SIZE + PAGE_SIZE;
+static const uint64_t KSTACK_SLOT_COUNT = 4096;
+
+static struct vmm_space_t kernel_space;
+
+static struct vmm_region_t kstacks_region;
+static uint64_t kstack_slot_words[4096 / 64];
+static struct bitmap_t kstack_slots;
+static struct spinlock_t kstack_lock = SPINLOCK_STATIC_INIT;
+
+static struct vmm_fault_stats_t fault_stats;
+
+// faults wait for the space with interrupts disabled, while whoever holds it may be waiting for a shootdown
+static void lock_space(struct vmm_space_t *space) {
+    bool old_int_state = interrupts_set(false);
+    while (!spin_trylock(&space->lock)) {
+        tlb_handle_shootdown();
+        pause();
+    }
+    space->lock.old_int_state = old_int_state;
+    space->lock_owner = get_cpu();
+}
+
+static inline void unlock_space(struct vmm_space_t *space) {
+    space->lock_owner = NULL;
+    spin_unlock_irqrestore(&space->lock);
+}
+
+static inline struct vmm_region_t *region_of(struct avl_node_t *node) {
+    return node == NULL ? NULL : AVL_ENTRY(node, struct vmm_region_t, tree_node);
+}
+
+static int region_cmp(struct avl_node_t *a, struct avl_node_t *b) {
+    uintptr_t a_start = region_of(a)->start;
+    uintptr_t b_start = region_of(b)->start;
+    return a_start < b_start ? -1 : a_start > b_start;
+}
+
+static bool tree_overlaps(struct avl_node_t *node, uintptr_t start, uintptr_t end) {
+    struct vmm_region_t *region = region_of(node);
+    if (region == NULL) {
+        return false;
+    }
+
+    if (region->start < end && start < region->start + region->length) {
+        return true;
+    }
+
+    return (start < region->start && tree_overlaps(node->left, start, end))
+        || (end > region->start && tree_overlaps(node->right, start, end));
+}
+
+// must be called with the space locked
+static struct vmm_region_t *find_region(struct vmm_space_t *space, uintptr_t virt) {
+    struct avl_node_t *node = space->regions.root;
+    while (node != NULL) {
+        struct vmm_region_t *region = region_of(node);
+        if (virt < region->start) {
+            node = node->left;
+        } else if (virt - region->start < region->length) {
+            return region;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return NULL;
+}
+
+static bool access_allowed(struct vmm_region_t *region, uint64_t error_code) {
+    if ((error_code & PF_WRITE) && !(region->flags & VMM_PAGE_WRITE)) {
+        return false;
+    }
+
+    if ((error_code & PF_USER) && !(region->flags & VMM_PAGE_USER)) {
+        return false;
+    }
+
+    return !(error_code & PF_INSTRUCTION_FETCH) || !(region->flags & VMM_PAGE_NX);
+}
+
+static bool in_guard_page(struct vmm_region_t *region, uintptr_t virt) {
+    return region->backing == VMM_BACKING_ZERO_GUARDED && (virt - region->start) % region->guard_stride < PAGE_SIZE;
+}
+
+static void page_fault_handler(struct int_ctx_t *ctx) {
+    uint64_t start_cycles = rdtsc();
+    uintptr_t virt = ctx->cr2;
+
+    // of the protection violations on committed pages, only writes to copy-on-write pages are resolved
+    bool present = ctx->error_code & PF_PRESENT;
+    if (present && !(ctx->error_code & PF_WRITE)) {
+        kpanic_int_ctx(ctx, "Page fault at 0x%016llx on a present page", virt);
+    }
+
+    // the user half belongs to the space loaded last, the kernel space has none
+    struct vmm_space_t *space = virt >= VMM_KERNEL_HALF_START ? &kernel_space : get_cpu()->space;
+    if (virt < VMM_KERNEL_HALF_START && space == &kernel_space) {
+        kpanic_int_ctx(ctx, "Page fault at 0x%016llx in the user half with no user space loaded", virt);
+    }
+
+    // the handler takes both, so a fault under either would never return
+    kassert(!pmm_lock_held());
+    kassert(space->lock_owner != get_cpu());
+
+    lock_space(space);
+
+    struct vmm_region_t *region = find_region(space, virt);
+    const char *reason = NULL;
+    if (region == NULL) {
+        reason = "outside of any region";
+    } else if (in_guard_page(region, virt)) {
+        reason = "in a guard page";
+    } else if (!access_allowed(region, ctx->error_code)) {
+        reason = "with an access the region does not allow";
+    }
+    if (reason == NULL && present && !vmm_copy_on_write(space->pagemap, virt, region->owner)) {
+        reason = "on a present page";
+    }
+    if (reason != NULL) {
+        unlock_space(space);
+        kpanic_int_ctx(ctx, "Page fault at 0x%016llx %s", virt, reason);
+    }
+
+    // another CPU may have committed the page since
+    uintptr_t page = align_down(virt, PAGE_SIZE);
+    bool spurious = !present && vmm_walk_page_cached(space->pagemap, page) != 0;
+    if (!present && !spurious) {
+        if (!(ctx->error_code & PF_WRITE) && !region->movable) {
+            // memory only read so far takes no page of its own
+            vmm_map_zero_page(space->pagemap, page, region->flags);
+        } else {
+            phys_t phys = pmm_alloc(true);
+            pmm_set_owner(phys, 1, region->owner);
+            vmm_map_page(space->pagemap, page, phys, region->flags);
+            if (region->movable) {
+                pmm_mark_movable(phys, page);
+            }
+        }
+    }
+
+    unlock_space(space);
+
+    uint64_t cycles = rdtsc() - start_cycles;
+    __atomic_fetch_add(&fault_stats.fault_count, 1, __ATOMIC_RELAXED);
+    if (spurious) {
+        __atomic_fetch_add(&fault_stats.spurious_count, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&fault_stats.time_cycles, cycles, __ATOMIC_RELAXED);
+    uint64_t max_cycles = __atomic_load_n(&fault_stats.max_time_cycles, __ATOMIC_RELAXED);
+    while (cycles > max_cycles && !__atomic_compare_exchange_n(&fault_stats.max_time_cycles, &max_cycles, cycles,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void vmm_space_init(void) {
+    kernel_space.pagemap = vmm_get_kernel_pagemap();
+    avl_init(&kernel_space.regions, region_cmp, NULL);
+    kernel_space.lock = SPINLOCK_INIT;
+    kernel_space.lock_owner = NULL;
+
+    bitmap_init(&kstack_slots, kstack_slot_words, NULL, KSTACK_SLOT_COUNT);
+    kstacks_region.start = KSTACKS_START;
+    kstacks_region.length = KSTACK_SLOT_COUNT * KSTACK_SLOT_SIZE;
+    kstacks_region.flags = VMM_PAGE_WRITE | VMM_PAGE_NX;
+    kstacks_region.backing = VMM_BACKING_ZERO_GUARDED;
+    kstacks_region.guard_stride = KSTACK_SLOT_SIZE;
+    kstacks_region.owner = PMM_OWNER_STACKS;
+    // a stopped CPU keeps using its stack, so stacks cannot be moved by compaction
+    kstacks_region.movable = false;
+    vmm_space_add_region(&kernel_space, &kstacks_region);
+
+    vmm_space_init_cpu();
+    idt_set_ist(PAGE_FAULT_VECTOR, PAGE_FAULT_IST);
+    interrupts_set_handler(PAGE_FAULT_VECTOR, page_fault_handler);
+
+    klog_info("VMM page fault handler installed");
+}
+
+void vmm_space_init_cpu(void) {
+    get_cpu()->space = &kernel_space;
+
+    phys_t stack = pmm_alloc_n(PAGE_FAULT_STACK_PAGES, false);
+    pmm_set_owner(stack, PAGE_FAULT_STACK_PAGES, PMM_OWNER_STACKS);
+    get_cpu()->tss.ist[PAGE_FAULT_IST - 1] = stack + vmm_get_hhdm_offset() + PAGE_FAULT_STACK_PAGES * PAGE_SIZE;
+}
+
+struct vmm_space_t *vmm_get_kernel_space(void) {
+    return &kernel_space;
+}
+
+struct vmm_space_t *vmm_space_create(phys_t pagemap) {
+    struct vmm_space_t *space = kmalloc(sizeof(struct vmm_space_t));
+    space->pagemap = pagemap;
+    avl_init(&space->regions, region_cmp, NULL);
+    space->lock = SPINLOCK_INIT;
+    space->lock_owner = NULL;
+    return space;
+}
+
+// inserts copies of the regions in the subtree of `node` into `clone`
+static void clone_regions(struct vmm_space_t *clone, struct avl_node_t *node) {
+    struct vmm_region_t *region = region_of(node);
+    if (region == NULL) {
+        return;
+    }
+
+    // movable pages have a single mapping, so they cannot be shared
+    kassert(!region->movable);
+
+    struct vmm_region_t *region_clone = kmalloc(sizeof(struct vmm_region_t));
+    *region_clone = *region;
+    avl_insert(&clone->regions, &region_clone->tree_node);
+
+    clone_regions(clone, node->left);
+    clone_regions(clone, node->right);
+}
+
+struct vmm_space_t *vmm_space_clone(struct vmm_space_t *space) {
+    kassert(space != &kernel_space);
+
+    lock_space(space);
+    struct vmm_space_t *clone = vmm_space_create(vmm_clone_pagemap(space->pagemap));
+    clone_regions(clone, space->regions.root);
+    unlock_space(space);
+
+    return clone;
+}
+
+void vmm_space_destroy(struct vmm_space_t *space) {
+    kassert(space != &kernel_space && space->regions.root == NULL);
+
+    vmm_free_pagemap(space->pagemap);
+    kfree(space);
+}
+
+void vmm_space_load(struct vmm_space_t *space) {
+    bool old_int_state = interrupts_set(false);
+    vmm_load_pagemap(space->pagemap);
+    get_cpu()->space = space;
+    interrupts_set(old_int_state);
+}
+
+void vmm_space_add_region(struct vmm_space_t *space, struct vmm_region_t *region) {
+    kassert(region->start % PAGE_SIZE == 0 && region->length % PAGE_SIZE == 0 && region->length != 0);
+    kassert(region->backing != VMM_BACKING_ZERO_GUARDED || region->guard_stride > PAGE_SIZE);
+
+    lock_space(space);
+
+    kassert(!tree_overlaps(space->regions.root, region->start, region->start + region->length));
+    avl_insert(&space->regions, &region->tree_node);
+
+    unlock_space(space);
+}
+
+void vmm_space_remove_region(struct vmm_space_t *space, struct vmm_region_t *region) {
+    lock_space(space);
+    avl_remove(&space->regions, &region->tree_node);
+    unlock_space(space);
+
+    vmm_space_decommit(space, region->start, region->length);
+}
+
+void vmm_space_decommit(struct vmm_space_t *space, uintptr_t start, uint64_t length) {
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, space->pagemap, start);
+
+    lock_space(space);
+    for (uint64_t i = 0; i < length / PAGE_SIZE; i++) {
+        phys_t phys = vmm_cursor_unmap(&cursor);
+        if (phys != 0 && phys != vmm_get_zero_page()) {
+            kassert((pmm_phys_to_page(phys)->flags & PAGE_FLAG_MOVABLE) == 0);
+            tlb_batch_free_page(&cursor.batch, phys);
+        }
+    }
+    unlock_space(space);
+
+    // CPUs spinning on the lock in the fault handler could not take the shootdown
+    vmm_cursor_finish(&cursor);
+}
+
+struct vmm_region_t *vmm_space_find_region(struct vmm_space_t *space, uintptr_t virt) {
+    lock_space(space);
+    struct vmm_region_t *region = find_region(space, virt);
+    unlock_space(space);
+    return region;
+}
+
+void *vmm_alloc_kstack(void) {
+    spin_lock_irqsave(&kstack_lock);
+
+    uint64_t slot = bitmap_find_first_zero(&kstack_slots);
+    if (slot == BITMAP_NOT_FOUND) {
+        kpanic("All kernel stack slots are in use");
+    }
+    bitmap_set_bit(&kstack_slots, slot);
+
+    spin_unlock_irqrestore(&kstack_lock);
+
+    uintptr_t start = KSTACKS_START + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+
+    // committed up front rather than on first touch: a stack reaching a new page while its thread
+    // holds a lock the fault handler takes, e.g. pmm_lock or a space lock, would deadlock in the handler
+    phys_t pages[VMM_KSTACK_SIZE / PAGE_SIZE];
+    for (uint64_t i = 0; i < VMM_KSTACK_SIZE / PAGE_SIZE; i++) {
+        pages[i] = pmm_alloc(true);
+        pmm_set_owner(pages[i], 1, PMM_OWNER_STACKS);
+    }
+
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, kernel_space.pagemap, start);
+
+    lock_space(&kernel_space);
+    for (uint64_t i = 0; i < VMM_KSTACK_SIZE / PAGE_SIZE; i++) {
+        vmm_cursor_map(&cursor, pages[i], kstacks_region.flags);
+    }
+    unlock_space(&kernel_space);
+
+    vmm_cursor_finish(&cursor);
+
+    return (void *) start;
+}
+
+void vmm_free_kstack(void *kstack) {
+    uintptr_t start = (uintptr_t) kstack;
+    uint64_t slot = (start - KSTACKS_START) / KSTACK_SLOT_SIZE;
+    kassert(start == KSTACKS_START + slot * KSTACK_SLOT_SIZE + PAGE_SIZE);
+
+    vmm_space_decommit(&kernel_space, start, VMM_KSTACK_SIZE);
+
+    spin_lock_irqsave(&kstack_lock);
+    kassert(bitmap_get_bit(&kstack_slots, slot));
+    bitmap_unset_bit(&kstack_slots, slot);
+    spin_unlock_irqrestore(&kstack_lock);
+}
+
+void vmm_get_fault_stats(struct vmm_fault_stats_t *stats) {
+    stats->fault_count = __atomic_load_n(&fault_stats.fault_count, __ATOMIC_RELAXED);
+    stats->spurious_count = __atomic_load_n(&fault_stats.spurious_count, __ATOMIC_RELAXED);
+    stats->time_cycles = __atomic_load_n(&fault_stats.time_cycles, __ATOMIC_RELAXED);
+    stats->max_time_cycles = __atomic_load_n(&fault_stats.max_time_cycles, __ATOMIC_RELAXED);
+}
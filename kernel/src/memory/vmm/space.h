@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/avl/avl.h"
+#include "lib/spinlock/spinlock.h"
+#include "memory/pmm/pmm.h"
+
+struct cpu_t;
+
+// kernel thread stacks are reserved here, each below a guard page
+#define VMM_KSTACK_SIZE 32768
+
+// how the pages of a region are backed
+enum vmm_backing {
+    // committed on first write with a zeroed page; reads before that map the zero page,
+    // unless the region is movable
+    VMM_BACKING_ZERO,
+    // as above, but the first page of every `guard_stride` bytes is never committed
+    VMM_BACKING_ZERO_GUARDED
+};
+
+// a range of reserved address space, committed lazily by the page fault handler
+struct vmm_region_t {
+    uintptr_t start;
+    uint64_t length;
+    // page flags the region is mapped with, which also decide the accesses allowed
+    uint64_t flags;
+    enum vmm_backing backing;
+    uint64_t guard_stride;
+    // committed pages are tagged with this
+    enum pmm_owner owner;
+    // committed pages are marked movable, see pmm_mark_movable
+    bool movable;
+    // in the regions of the space, ordered by start
+    struct avl_node_t tree_node;
+};
+
+struct vmm_space_t {
+    phys_t pagemap;
+    struct avl_tree_t regions;
+    // faults take this with interrupts disabled, so nothing touching uncommitted pages may hold it
+    // waiters take pending shootdowns, so it may be held while flushing
+    struct spinlock_t lock;
+    // the CPU holding the lock, so that faults can check they were not taken under it
+    struct cpu_t *lock_owner;
+};
+
+struct vmm_fault_stats_t {
+    // faults handled / of them, those that found the page already committed by another CPU
+    uint64_t fault_count;
+    uint64_t spurious_count;
+    // time spent in the handler, in TSC cycles
+    uint64_t time_cycles;
+    uint64_t max_time_cycles;
+};
+
+// installs the page fault handler, must be called before anything is committed lazily
+void vmm_space_init(void);
+// sets up the stack this CPU handles page faults on, must be called with the kernel pagemap loaded
+void vmm_space_init_cpu(void);
+struct vmm_space_t *vmm_get_kernel_space(void);
+// a space for the user half of `pagemap`
+struct vmm_space_t *vmm_space_create(phys_t pagemap);
+// a space with the regions of `space`, sharing the pages committed in them copy-on-write
+// the regions are copied into kmalloc'd structs, which are the caller's to kfree once removed
+struct vmm_space_t *vmm_space_clone(struct vmm_space_t *space);
+// `space` must have no regions left and be loaded on no CPU
+void vmm_space_destroy(struct vmm_space_t *space);
+// loads the pagemap of `space` on this CPU, whose user half faults are then resolved in `space`
+void vmm_space_load(struct vmm_space_t *space);
+// `region` must stay allocated until removed, and must not overlap any other region
+// its storage must be committed already, which writing its fields takes care of
+void vmm_space_add_region(struct vmm_space_t *space, struct vmm_region_t *region);
+// removes `region` and frees the pages committed in it
+void vmm_space_remove_region(struct vmm_space_t *space, struct vmm_region_t *region);
+// frees the pages committed in [start, start + length), which stays reserved
+// compaction could move the pages while they wait for the flush, so the range must not be movable
+void vmm_space_decommit(struct vmm_space_t *space, uintptr_t start, uint64_t length);
+struct vmm_region_t *vmm_space_find_region(struct vmm_space_t *space, uintptr_t virt);
+// returns the lowest address of a VMM_KSTACK_SIZE byte stack, committed as a whole
+// so that running on it never faults, whatever locks its thread holds
+void *vmm_alloc_kstack(void);
+void vmm_free_kstack(void *kstack);
+void vmm_get_fault_stats(struct vmm_fault_stats_t *stats);
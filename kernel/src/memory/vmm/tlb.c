@@ -0,0 +1,315 @@
+#include "arch/x86_64/apic/lapic.h"
+#include "arch/x86_64/asm.h"
+#include "arch/x86_64/interrupts/interrupts.h"
+#include "kassert/kassert.h"
+#include "klog/klog.h"
+#include "lib/spinlock/spinlock.h"
+#include "memory/vmm/tlb.h"
+#include "memory/vmm/vmm.h"
+#include "mp/cpu.h"
+#include "mp/mp.h"
+
+static const uint64_t CR4_PGE = 1 << 7;
+static const uint64_t CR4_PCIDE = 1 << 17;
+// loading CR3 with this set keeps the TLB entries of the PCID loaded
+static const uint64_t CR3_NO_FLUSH = 1ull << 63;
+
+static bool pge_enabled;
+static bool pcid_enabled;
+
+static uint8_t shootdown_vector;
+static uint64_t full_flush_threshold = 32;
+
+// the shootdown being carried out, there is only one at a time
+static struct spinlock_t shootdown_lock = SPINLOCK_STATIC_INIT;
+static struct tlb_batch_t shootdown;
+// CPUs that have yet to carry it out
+static uint64_t shootdown_pending_count;
+
+static struct tlb_stats_t tlb_stats;
+
+// must be called with interrupts disabled
+static bool may_cache(struct cpu_t *cpu, phys_t pagemap) {
+    if (__atomic_load_n(&cpu->pagemap, __ATOMIC_SEQ_CST) == pagemap) {
+        return true;
+    }
+
+    for (uint16_t pcid = 0; pcid < TLB_PCID_COUNT; pcid++) {
+        if (__atomic_load_n(&cpu->pcid_pagemaps[pcid], __ATOMIC_SEQ_CST) == pagemap) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// must be called with interrupts disabled
+static void flush_local(struct tlb_batch_t *batch) {
+    struct cpu_t *cpu = get_cpu();
+
+    // kernel half mappings are global, so they are cached whichever pagemap is loaded
+    if (batch->kernel && batch->full) {
+        tlb_flush_all_local();
+        return;
+    }
+
+    if (!batch->kernel && batch->pagemap != cpu->pagemap) {
+        // the pagemap may still be cached under the PCID it had here, which is cheaper
+        // to give up than to flush; its next load recycles another one
+        for (uint16_t pcid = 1; pcid < TLB_PCID_COUNT; pcid++) {
+            if (cpu->pcid_pagemaps[pcid] == batch->pagemap) {
+                __atomic_store_n(&cpu->pcid_pagemaps[pcid], 0, __ATOMIC_SEQ_CST);
+            }
+        }
+        return;
+    }
+
+    if (batch->full) {
+        // flushes the non-global entries of the current PCID only
+        wr_cr3(rd_cr3());
+        return;
+    }
+
+    for (uint8_t i = 0; i < batch->range_count; i++) {
+        for (uintptr_t virt = batch->ranges[i].start; virt < batch->ranges[i].end; virt += PAGE_SIZE) {
+            invlpg(virt);
+        }
+    }
+}
+
+// must be called with interrupts disabled
+static void lock_shootdown(void) {
+    // whoever holds the lock may be waiting for this CPU
+    while (!spin_trylock(&shootdown_lock)) {
+        tlb_handle_shootdown();
+        pause();
+    }
+}
+
+static void shootdown_handler(struct int_ctx_t *ctx) {
+    (void) ctx;
+    tlb_handle_shootdown();
+    lapic_send_eoi();
+}
+
+// must be called with interrupts disabled
+static void send_shootdown(struct tlb_batch_t *batch) {
+    // this also orders the page table writes before the reads of the pagemaps loaded by the other CPUs
+    lock_shootdown();
+
+    shootdown = *batch;
+
+    struct cpu_t *this_cpu = get_cpu();
+    struct cpu_t **cpus = mp_get_cpus();
+    uint64_t cpu_count = mp_get_cpu_count();
+    uint64_t ipi_count = 0;
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < cpu_count; i++) {
+        struct cpu_t *cpu = cpus[i];
+        // a CPU that loads the pagemap after this sees the updated page tables
+        if (cpu == this_cpu || (!batch->kernel && !batch->tables && !may_cache(cpu, batch->pagemap))) {
+            continue;
+        }
+
+        __atomic_fetch_add(&shootdown_pending_count, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&cpu->tlb_shootdown_pending, true, __ATOMIC_SEQ_CST);
+        lapic_ipi(shootdown_vector, cpu->lapic_id);
+        ipi_count++;
+    }
+
+    while (__atomic_load_n(&shootdown_pending_count, __ATOMIC_SEQ_CST) != 0) {
+        pause();
+    }
+    uint64_t wait_cycles = rdtsc() - start;
+
+    if (ipi_count != 0) {
+        tlb_stats.shootdown_count++;
+        tlb_stats.ipi_count += ipi_count;
+        tlb_stats.wait_cycles += wait_cycles;
+        if (wait_cycles > tlb_stats.max_wait_cycles) {
+            tlb_stats.max_wait_cycles = wait_cycles;
+        }
+    }
+
+    spin_unlock(&shootdown_lock);
+}
+
+void tlb_init(void) {
+    shootdown_vector = interrupts_alloc_vector();
+    interrupts_set_handler(shootdown_vector, shootdown_handler);
+
+    klog_debug("TLB global pages enabled? %s, PCIDs enabled? %s", pge_enabled ? "yes" : "no", pcid_enabled ? "yes" : "no");
+}
+
+void tlb_init_cpu(phys_t pagemap) {
+    // the CPU struct may not be accessible through the pagemap loaded before, so CPUID is issued directly
+    uint32_t eax, ebx, ecx, edx;
+    cpuid_no_leaf_check(1, 0, &eax, &ebx, &ecx, &edx);
+    pge_enabled = edx & (1 << 13);
+    // without global pages, flushing the kernel half would mean flushing every PCID one by one
+    pcid_enabled = pge_enabled && (ecx & (1 << 17));
+
+    if (pge_enabled) {
+        wr_cr4(rd_cr4() | CR4_PGE);
+    }
+    if (pcid_enabled) {
+        wr_cr4(rd_cr4() | CR4_PCIDE);
+    }
+
+    struct cpu_t *cpu = get_cpu();
+    cpu->pagemap = pagemap;
+    for (uint16_t pcid = 0; pcid < TLB_PCID_COUNT; pcid++) {
+        cpu->pcid_pagemaps[pcid] = 0;
+    }
+    cpu->pcid_pagemaps[0] = pagemap;
+    cpu->pcid_next = 1;
+}
+
+uint64_t tlb_switch_pagemap(phys_t pagemap) {
+    struct cpu_t *cpu = get_cpu();
+
+    // published before the load, so that shootdowns sent meanwhile are not missed
+    __atomic_store_n(&cpu->pagemap, pagemap, __ATOMIC_SEQ_CST);
+
+    if (!pcid_enabled) {
+        return pagemap;
+    }
+
+    for (uint16_t pcid = 0; pcid < TLB_PCID_COUNT; pcid++) {
+        if (cpu->pcid_pagemaps[pcid] == pagemap) {
+            return pagemap | pcid | CR3_NO_FLUSH;
+        }
+    }
+
+    // loading without CR3_NO_FLUSH drops whatever the recycled PCID still holds
+    uint16_t pcid = cpu->pcid_next;
+    cpu->pcid_next = pcid % (TLB_PCID_COUNT - 1) + 1;
+    __atomic_store_n(&cpu->pcid_pagemaps[pcid], pagemap, __ATOMIC_SEQ_CST);
+    return pagemap | pcid;
+}
+
+void tlb_batch_init(struct tlb_batch_t *batch, phys_t pagemap) {
+    batch->pagemap = pagemap;
+    batch->page_count = 0;
+    batch->range_count = 0;
+    batch->full = false;
+    batch->kernel = false;
+    batch->tables = false;
+    batch->freed_pages = NULL;
+}
+
+void tlb_batch_add(struct tlb_batch_t *batch, uintptr_t virt, uint64_t page_count) {
+    bool kernel = virt >= VMM_KERNEL_HALF_START;
+    // kernel and user mappings are flushed differently
+    kassert(batch->page_count == 0 || batch->kernel == kernel);
+    batch->kernel = kernel;
+    batch->page_count += page_count;
+
+    if (batch->full) {
+        return;
+    }
+
+    if (batch->page_count > full_flush_threshold) {
+        batch->full = true;
+        return;
+    }
+
+    uintptr_t end = virt + page_count * PAGE_SIZE;
+    if (batch->range_count != 0 && batch->ranges[batch->range_count - 1].end == virt) {
+        batch->ranges[batch->range_count - 1].end = end;
+    } else if (batch->range_count == TLB_BATCH_MAX_RANGES) {
+        batch->full = true;
+    } else {
+        batch->ranges[batch->range_count].start = virt;
+        batch->ranges[batch->range_count].end = end;
+        batch->range_count++;
+    }
+}
+
+void tlb_batch_free_table(struct tlb_batch_t *batch, phys_t table) {
+    // invlpg drops the cached paging-structure entries of the current PCID only, and those of
+    // the kernel half are cached under every PCID
+    if (batch->kernel && pcid_enabled) {
+        batch->full = true;
+    }
+    batch->tables = true;
+
+    tlb_batch_free_page(batch, table);
+}
+
+void tlb_batch_free_page(struct tlb_batch_t *batch, phys_t page) {
+    struct page_t *descriptor = pmm_phys_to_page(page);
+    descriptor->links.next = batch->freed_pages;
+    batch->freed_pages = descriptor;
+}
+
+void tlb_batch_flush(struct tlb_batch_t *batch) {
+    if (batch->page_count == 0) {
+        kassert(batch->freed_pages == NULL);
+        return;
+    }
+
+    bool old_int_state = interrupts_set(false);
+
+    flush_local(batch);
+    // stopped CPUs flush their TLB before resuming anyway
+    if (mp_get_cpu_count() > 1 && !mp_other_cpus_stopped()) {
+        send_shootdown(batch);
+    }
+
+    interrupts_set(old_int_state);
+
+    __atomic_fetch_add(&tlb_stats.flush_count, 1, __ATOMIC_RELAXED);
+    if (batch->full) {
+        __atomic_fetch_add(&tlb_stats.full_flush_count, 1, __ATOMIC_RELAXED);
+    }
+
+    while (batch->freed_pages != NULL) {
+        struct page_t *page = batch->freed_pages;
+        batch->freed_pages = page->links.next;
+        pmm_page_put(pmm_page_to_phys(page));
+    }
+
+    tlb_batch_init(batch, batch->pagemap);
+}
+
+void tlb_flush_page(phys_t pagemap, uintptr_t virt) {
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+    tlb_batch_add(&batch, virt, 1);
+    tlb_batch_flush(&batch);
+}
+
+void tlb_flush_all_local(void) {
+    if (pge_enabled) {
+        // toggling global pages flushes all PCIDs
+        uint64_t cr4 = rd_cr4();
+        wr_cr4(cr4 & ~CR4_PGE);
+        wr_cr4(cr4);
+    } else {
+        wr_cr3(rd_cr3());
+    }
+}
+
+void tlb_handle_shootdown(void) {
+    struct cpu_t *cpu = get_cpu();
+    if (!__atomic_exchange_n(&cpu->tlb_shootdown_pending, false, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    flush_local(&shootdown);
+    __atomic_fetch_sub(&shootdown_pending_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void tlb_set_full_flush_threshold(uint64_t page_count) {
+    full_flush_threshold = page_count;
+}
+
+void tlb_get_stats(struct tlb_stats_t *stats) {
+    bool old_int_state = interrupts_set(false);
+    lock_shootdown();
+    *stats = tlb_stats;
+    spin_unlock(&shootdown_lock);
+    interrupts_set(old_int_state);
+}
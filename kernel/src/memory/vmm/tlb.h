@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memory/pmm/pmm.h"
+
+// ranges a batch can hold before it falls back to a full flush
+#define TLB_BATCH_MAX_RANGES 8
+
+// PCIDs each CPU hands out to the pagemaps it loads, recycling them round robin
+// PCID 0 stays with the kernel pagemap
+#define TLB_PCID_COUNT 16
+
+// invalidations gathered for one pagemap, carried out on every CPU that may cache them at once
+struct tlb_batch_t {
+    phys_t pagemap;
+    uint64_t page_count;
+    uint8_t range_count;
+    // set once the ranges do not fit, or cover more pages than the full flush threshold
+    bool full;
+    // some range is in the kernel half, which every pagemap shares
+    bool kernel;
+    // page tables were unlinked, so every CPU must take part, whether it may cache the pagemap or not
+    bool tables;
+    struct {
+        uintptr_t start;
+        uintptr_t end;
+    } ranges[TLB_BATCH_MAX_RANGES];
+    // pages unmapped and page tables unlinked from the pagemap, freed once no CPU can access them anymore
+    struct page_t *freed_pages;
+};
+
+struct tlb_stats_t {
+    // batches flushed / of them, those flushed in full
+    uint64_t flush_count;
+    uint64_t full_flush_count;
+    // batches that had to be sent to other CPUs, and the IPIs that took
+    uint64_t shootdown_count;
+    uint64_t ipi_count;
+    // time initiators spent waiting for the other CPUs, in TSC cycles
+    uint64_t wait_cycles;
+    uint64_t max_wait_cycles;
+};
+
+// must be called before the APs are started
+void tlb_init(void);
+// enables global pages and PCIDs if supported, must be called with `pagemap` loaded with PCID 0
+void tlb_init_cpu(phys_t pagemap);
+// picks the PCID for `pagemap` on this CPU, returning the value to load into CR3
+// must be called with interrupts disabled, right before loading it
+uint64_t tlb_switch_pagemap(phys_t pagemap);
+void tlb_batch_init(struct tlb_batch_t *batch, phys_t pagemap);
+void tlb_batch_add(struct tlb_batch_t *batch, uintptr_t virt, uint64_t page_count);
+// frees `table` after the batch is flushed; it must have been unlinked from the pagemap
+// while mapping pages added to the batch, which the paging-structure caches are invalidated with
+// the flush waits for every CPU, so that software walks, which run with interrupts disabled, are done with it
+void tlb_batch_free_table(struct tlb_batch_t *batch, phys_t table);
+// drops a reference to `page` after the batch is flushed, freeing it with the last one
+// the mapping it is dropped for must have been at a page added to the batch
+void tlb_batch_free_page(struct tlb_batch_t *batch, phys_t page);
+// invalidates the batch on this CPU and on the CPUs that may cache it, waiting for them, then empties it
+// the other CPUs must be able to take the IPI: this must not be called while holding
+// a spinlock they might be waiting for with interrupts disabled
+void tlb_batch_flush(struct tlb_batch_t *batch);
+void tlb_flush_page(phys_t pagemap, uintptr_t virt);
+// flushes every TLB entry on this CPU, global ones and those of other PCIDs included
+void tlb_flush_all_local(void);
+// carries out the shootdown this CPU was sent, if any; for loops waiting on other CPUs with interrupts disabled
+void tlb_handle_shootdown(void);
+// batches of more pages than this are flushed in full instead of page by page
+void tlb_set_full_flush_threshold(uint64_t page_count);
+void tlb_get_stats(struct tlb_stats_t *stats);
@@ -1,13 +1,34 @@
 #include "arch/x86_64/asm.h"
+#include "arch/x86_64/msr.h"
+#include "kassert/kassert.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
 #include "lib/align.h"
+#include "lib/memutil.h"
+#include "lib/spinlock/spinlock.h"
 #include "memory/pmm/pmm.h"
+#include "memory/vmm/tlb.h"
 #include "memory/vmm/vmm.h"
+#include "mp/cpu.h"
 
 static const uint64_t VMM_PAGE_PRESENT = 1 << 0;
+// in a pml3 or pml2 entry: the entry maps a 1GiB or 2MiB page instead of pointing to a table
+static const uint64_t VMM_PAGE_LARGE = 1 << 7;
+static const uint64_t VMM_PAGE_GLOBAL = 1 << 8;
+// the PAT bit is bit 7 in pml1 entries, but bit 12 in large page entries
+static const uint64_t VMM_PAGE_PAT = 1 << 7;
+static const uint64_t VMM_PAGE_LARGE_PAT = 1 << 12;
+// available to software: the page is shared read-only until written to, see vmm_copy_on_write
+static const uint64_t VMM_PAGE_COW = 1 << 9;
 static const uint64_t VMM_FLAGS_HHDM = VMM_PAGE_WRITE | VMM_PAGE_NX;
 
+// makes the kernel fault on writes to read-only pages too, which copy-on-write relies on
+static const uint64_t CR0_WP = 1 << 16;
+
+// PAT entries 0 to 3 are WB, WC, UC- and UC, to match VMM_PAGE_CACHE_*
+// entries 4 to 7 repeat them, so that the PAT bit makes no difference
+static const uint64_t PAT_VALUE = 0x0007010600070106;
+
 typedef uint64_t pml_entry_t;
 static const uint64_t PTE_PHYS_ADDR_MASK = 0x7fffffffff000;
 
@@ -19,9 +40,146 @@ extern unsigned char __LIMINE_REQUESTS_START[], __LIMINE_REQUESTS_END[];
 static uintptr_t hhdm_offset;
 
 static phys_t kernel_pagemap;
+// mapped read-only wherever anonymous memory was read before being written to, never freed
+static phys_t zero_page;
+
+static bool pages_1g_supported;
+// page tables in use
+static uint64_t page_table_count;
+// bumped whenever a page table is unlinked, which invalidates the walk caches
+static uint64_t walk_generation;
+// tables keep count of their present entries in their page descriptors once those are set up,
+// so that tables left empty by unmapping can be freed
+static bool table_counts_ready;
+
+// page tables are updated concurrently without a lock for the whole pagemap:
+// - tables are installed with a compare-and-swap of the entry pointing to them
+// - leaf entries are changed with the pml1 locked, see cursor_lock_pml1_entry
+// - a table whose count drops to 0 is marked dead, so that nothing is added to it anymore,
+//   and unlinked by whoever marked it; walks that find it dead start over from the top
+// - software walks run with interrupts disabled, and unlinked tables are freed only after a
+//   shootdown every CPU took part in, so the tables walked to stay around until the walk is done
+// mapping large pages is not covered, they must not be mapped over a range that is updated meanwhile
+static const uint32_t TABLE_DEAD = UINT32_MAX;
+
+// kernel half mappings are the same in every pagemap, so they can survive CR3 loads
+static inline uint64_t leaf_flags(uintptr_t virt, uint64_t flags) {
+    return virt >= VMM_KERNEL_HALF_START ? flags | VMM_PAGE_GLOBAL : flags;
+}
+
+static phys_t alloc_page_table(void) {
+    phys_t table = pmm_alloc(true);
+    pmm_set_owner(table, 1, PMM_OWNER_PAGE_TABLES);
+    if (table_counts_ready) {
+        pmm_phys_to_page(table)->entry_count = 0;
+        pmm_phys_to_page(table)->table_lock = SPINLOCK_INIT;
+    }
+    __atomic_fetch_add(&page_table_count, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+static inline uint16_t get_pml_index(uintptr_t virt, uint8_t level) {
+    return (virt >> (12 + 9 * (level - 1))) & 0x1ff;
+}
+
+// must be called whenever an entry becomes present
+static inline void count_entry(pml_entry_t *pml_entry) {
+    if (table_counts_ready) {
+        phys_t table = align_down((uintptr_t) pml_entry - hhdm_offset, PAGE_SIZE);
+        __atomic_fetch_add(&pmm_phys_to_page(table)->entry_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// counts an entry about to be added to `table`, which keeps it from being unlinked meanwhile
+// fails if the table is dead already
+static bool get_table(phys_t table) {
+    if (!table_counts_ready) {
+        return true;
+    }
+
+    uint32_t *entry_count = &pmm_phys_to_page(table)->entry_count;
+    uint32_t count = __atomic_load_n(entry_count, __ATOMIC_ACQUIRE);
+    do {
+        if (count == TABLE_DEAD) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(entry_count, &count, count + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return true;
+}
+
+// drops the count of an entry cleared from `table`; returns whether this left it empty
+// and marked it dead, in which case the caller must unlink it
+static bool put_table(phys_t table, bool may_unlink) {
+    if (!table_counts_ready) {
+        return false;
+    }
+
+    uint32_t *entry_count = &pmm_phys_to_page(table)->entry_count;
+    uint32_t count = __atomic_sub_fetch(entry_count, 1, __ATOMIC_ACQ_REL);
+    kassert(count != TABLE_DEAD);
+    if (count != 0 || !may_unlink) {
+        return false;
+    }
+
+    // fails if an entry is being added meanwhile
+    return __atomic_compare_exchange_n(entry_count, &count, TABLE_DEAD, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+struct hhdm_stats_t {
+    uint64_t page_1g_count;
+    uint64_t page_2m_count;
+    uint64_t page_4k_count;
+    // pml1 tables holding 4KiB pages, and how many it would take with 4KiB pages only
+    uint64_t pml1_count;
+    uint64_t pml1_count_4k_only;
+};
+
+// maps [start, end) of physical memory into the HHDM with the largest pages that fit
+static void map_hhdm_range(phys_t start, phys_t end, uint64_t flags, struct hhdm_stats_t *stats) {
+    stats->pml1_count_4k_only += align_up(end, VMM_PAGE_SIZE_2M) / VMM_PAGE_SIZE_2M - start / VMM_PAGE_SIZE_2M;
+
+    phys_t phys = start;
+    while (phys < end) {
+        uintptr_t virt = phys + hhdm_offset;
+
+        if (pages_1g_supported && virt % VMM_PAGE_SIZE_1G == 0 && phys % VMM_PAGE_SIZE_1G == 0
+                && end - phys >= VMM_PAGE_SIZE_1G) {
+            vmm_map_page_1g(kernel_pagemap, virt, phys, flags);
+            stats->page_1g_count++;
+            phys += VMM_PAGE_SIZE_1G;
+        } else if (virt % VMM_PAGE_SIZE_2M == 0 && phys % VMM_PAGE_SIZE_2M == 0 && end - phys >= VMM_PAGE_SIZE_2M) {
+            vmm_map_page_2m(kernel_pagemap, virt, phys, flags);
+            stats->page_2m_count++;
+            phys += VMM_PAGE_SIZE_2M;
+        } else {
+            // the first 4KiB page in a 2MiB window takes a new pml1
+            if (phys == start || phys % VMM_PAGE_SIZE_2M == 0) {
+                stats->pml1_count++;
+            }
+            vmm_map_page(kernel_pagemap, virt, phys, flags);
+            stats->page_4k_count++;
+            phys += PAGE_SIZE;
+        }
+    }
+}
 
 void vmm_init(struct limine_memmap_response *memmap, struct limine_executable_address_response *executable_addr) {
-    kernel_pagemap = pmm_alloc(true);
+    uint32_t eax, ebx, ecx, edx;
+    if (cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx)) {
+        pages_1g_supported = edx & (1 << 26);
+    }
+
+    uint64_t start_cycles = rdtsc();
+
+    kernel_pagemap = alloc_page_table();
+    zero_page = pmm_alloc(true);
+    // every pagemap shares the pml3 tables of the kernel half, so the pml4 entries pointing
+    // to them are all filled in now and never change afterwards
+    pml_entry_t *kernel_pml4 = (pml_entry_t *) (kernel_pagemap + hhdm_offset);
+    for (uint16_t i = 256; i < 512; i++) {
+        kernel_pml4[i] = (pml_entry_t) alloc_page_table() | VMM_PAGE_PRESENT | VMM_PAGE_WRITE | VMM_PAGE_USER;
+    }
 
     uintptr_t text_start = (uintptr_t) &__TEXT_START;
     uintptr_t text_end   = (uintptr_t) &__TEXT_END;
@@ -58,25 +216,107 @@ void vmm_init(struct limine_memmap_response *memmap, struct limine_executable_ad
         vmm_map_page(kernel_pagemap, virt, phys, VMM_PAGE_NX);
     }
 
+    uint64_t kernel_page_table_count = page_table_count;
+
+    // adjacent entries are mapped as one range, so that large pages can span them
+    struct hhdm_stats_t stats = { 0 };
+    phys_t range_start = 0;
+    phys_t range_end = 0;
+    for (uint64_t i = 0; i <= memmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = i < memmap->entry_count ? memmap->entries[i] : NULL;
+
+        // map only usable, bootloader recl, kernel/modules and framebuffer entries
+        // as per Limine base revision 3; the framebuffer is mapped on its own below
+        if (entry != NULL && entry->type != LIMINE_MEMMAP_USABLE && entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE
+        && entry->type != LIMINE_MEMMAP_EXECUTABLE_AND_MODULES) {
+            continue;
+        }
+
+        uintptr_t entry_start = entry != NULL ? align_down(entry->base, PAGE_SIZE) : 0;
+        uintptr_t entry_end = entry != NULL ? align_up(entry->base + entry->length, PAGE_SIZE) : 0;
+
+        if (entry != NULL && entry_start <= range_end && range_end != range_start) {
+            range_end = entry_end > range_end ? entry_end : range_end;
+            continue;
+        }
+
+        if (range_end != range_start) {
+            map_hhdm_range(range_start, range_end, VMM_FLAGS_HHDM, &stats);
+        }
+
+        range_start = entry_start;
+        range_end = entry_end;
+    }
+
+    // the framebuffer is only ever written to, and write-combining makes that much faster
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type == LIMINE_MEMMAP_FRAMEBUFFER) {
+            map_hhdm_range(align_down(entry->base, PAGE_SIZE), align_up(entry->base + entry->length, PAGE_SIZE),
+                    VMM_FLAGS_HHDM | VMM_PAGE_CACHE_WC, &stats);
+        }
+    }
 
-        // map only usable, bootloader recl, kernel/modules and framebuffer entries
-        // as per Limine base revision 3
-        if (entry->type == LIMINE_MEMMAP_USABLE || entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE
-        || entry->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES || entry->type == LIMINE_MEMMAP_FRAMEBUFFER) {
-            uintptr_t entry_start = align_down(entry->base, PAGE_SIZE);
-            uintptr_t entry_end = align_up(entry->base + entry->length, PAGE_SIZE);
-
-            for (uintptr_t j = entry_start; j < entry_end; j += PAGE_SIZE) {
-                vmm_map_page(kernel_pagemap, j + hhdm_offset, j, VMM_FLAGS_HHDM);
-            }
+    uint64_t hhdm_page_table_count = page_table_count - kernel_page_table_count;
+    uint64_t hhdm_page_table_count_4k_only = hhdm_page_table_count - stats.pml1_count + stats.pml1_count_4k_only;
+    uint64_t cycles = rdtsc() - start_cycles;
+
+    vmm_init_cpu();
+
+    klog_info("VMM initialized in %llu cycles", cycles);
+    klog_debug("VMM HHDM mapped with %llu 1GiB, %llu 2MiB and %llu 4KiB pages, instead of %llu 4KiB pages",
+            stats.page_1g_count, stats.page_2m_count, stats.page_4k_count,
+            stats.page_4k_count + stats.page_2m_count * 512 + stats.page_1g_count * 512 * 512);
+    klog_debug("VMM HHDM page tables: %llu KiB, instead of %llu KiB with 4KiB pages only",
+            hhdm_page_table_count * PAGE_SIZE >> 10, hhdm_page_table_count_4k_only * PAGE_SIZE >> 10);
+}
+
+static void init_pat(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid_no_leaf_check(1, 0, &eax, &ebx, &ecx, &edx);
+    // without a PAT, PWT alone selects write-through instead of write-combining, the other types stay the same
+    if (!(edx & (1 << 16))) {
+        return;
+    }
+
+    // nothing may be cached with a memory type that is about to change
+    wbinvd();
+    wrmsr(MSR_IA32_PAT, PAT_VALUE);
+}
+
+void vmm_init_cpu(void) {
+    // every CPU must use the same PAT; the CR3 load below drops translations made with the old one
+    init_pat();
+    wr_cr0(rd_cr0() | CR0_WP);
+    wr_cr3(kernel_pagemap);
+    tlb_init_cpu(kernel_pagemap);
+}
+
+static void init_table_count(phys_t table, uint8_t level) {
+    pml_entry_t *table_hhdm = (pml_entry_t *) (table + hhdm_offset);
+    uint32_t entry_count = 0;
+    for (uint16_t i = 0; i < 512; i++) {
+        if (!(table_hhdm[i] & VMM_PAGE_PRESENT)) {
+            continue;
+        }
+
+        entry_count++;
+        if (level > 1 && !(table_hhdm[i] & VMM_PAGE_LARGE)) {
+            init_table_count(table_hhdm[i] & PTE_PHYS_ADDR_MASK, level - 1);
         }
     }
 
-    vmm_load_pagemap(kernel_pagemap);
+    pmm_phys_to_page(table)->entry_count = entry_count;
+    pmm_phys_to_page(table)->table_lock = SPINLOCK_INIT;
+}
 
-    klog_info("VMM initialized");
+void vmm_init_table_counts(void) {
+    init_table_count(kernel_pagemap, 4);
+    table_counts_ready = true;
+}
+
+uint64_t vmm_get_page_table_count(void) {
+    return __atomic_load_n(&page_table_count, __ATOMIC_RELAXED);
 }
 
 uintptr_t vmm_get_hhdm_offset(void) {
@@ -87,63 +327,386 @@ phys_t vmm_get_kernel_pagemap(void) {
     return kernel_pagemap;
 }
 
+phys_t vmm_get_zero_page(void) {
+    return zero_page;
+}
+
+phys_t vmm_new_pagemap(void) {
+    phys_t pagemap = alloc_page_table();
+
+    pml_entry_t *kernel_pml4 = (pml_entry_t *) (kernel_pagemap + hhdm_offset);
+    pml_entry_t *pml4 = (pml_entry_t *) (pagemap + hhdm_offset);
+    for (uint16_t i = 256; i < 512; i++) {
+        pml4[i] = kernel_pml4[i];
+    }
+    if (table_counts_ready) {
+        pmm_phys_to_page(pagemap)->entry_count = 256;
+    }
+
+    return pagemap;
+}
+
 void vmm_load_pagemap(phys_t pagemap) {
-    wr_cr3(pagemap);
+    bool old_int_state = interrupts_set(false);
+    wr_cr3(tlb_switch_pagemap(pagemap));
+    interrupts_set(old_int_state);
 }
 
-static phys_t get_next_pml(phys_t pml, uint16_t pml_index) {
+static inline pml_entry_t *get_pml_entry(phys_t pml, uint16_t pml_index) {
     pml_entry_t *pml_hhdm = (pml_entry_t *) (pml + hhdm_offset);
-    pml_entry_t *pml_entry = &pml_hhdm[pml_index];
+    return &pml_hhdm[pml_index];
+}
+
+// replaces the large page `old_entry` in `pml_entry` with a table of 512 pages,
+// which together map the same memory with the same flags
+// returns 0 if the entry changed meanwhile
+static phys_t split_large_page(pml_entry_t *pml_entry, pml_entry_t old_entry, uint64_t large_page_size) {
+    uint64_t page_size = large_page_size / 512;
+    phys_t phys = old_entry & PTE_PHYS_ADDR_MASK & ~(large_page_size - 1);
+    uint64_t flags = old_entry & ~PTE_PHYS_ADDR_MASK;
+    bool pat = old_entry & VMM_PAGE_LARGE_PAT;
+
+    if (page_size == PAGE_SIZE) {
+        flags &= ~VMM_PAGE_LARGE;
+        flags |= pat ? VMM_PAGE_PAT : 0;
+    } else {
+        flags |= pat ? VMM_PAGE_LARGE_PAT : 0;
+    }
+
+    phys_t table = alloc_page_table();
+    pml_entry_t *table_hhdm = (pml_entry_t *) (table + hhdm_offset);
+    for (uint16_t i = 0; i < 512; i++) {
+        table_hhdm[i] = (phys + i * page_size) | flags;
+    }
+    if (table_counts_ready) {
+        pmm_phys_to_page(table)->entry_count = 512;
+    }
+
+    // the translations stay the same, so no TLB entry needs to be invalidated
+    pml_entry_t new_entry = (pml_entry_t) table | VMM_PAGE_PRESENT | VMM_PAGE_WRITE | VMM_PAGE_USER;
+    if (!__atomic_compare_exchange_n(pml_entry, &old_entry, new_entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pmm_free(table);
+        __atomic_fetch_sub(&page_table_count, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return table;
+}
+
+// `large_page_size` is the size of the page the entry would map if it were a large page,
+// or 0 if it cannot be one; a large page in the way is split
+// a missing table is allocated if `alloc` is set, otherwise 0 is returned
+// with `alloc` set, 0 is returned if `pml` turned out to be dead, and the walk must start over
+// must be called with interrupts disabled
+static phys_t get_next_pml(phys_t pml, uint16_t pml_index, uint64_t large_page_size, bool alloc) {
+    pml_entry_t *pml_entry = get_pml_entry(pml, pml_index);
+
+    for (;;) {
+        pml_entry_t entry = __atomic_load_n(pml_entry, __ATOMIC_ACQUIRE);
 
-    if (*pml_entry & VMM_PAGE_PRESENT) {
-        return *pml_entry & PTE_PHYS_ADDR_MASK;
+        if (entry & VMM_PAGE_PRESENT) {
+            if (large_page_size == 0 || !(entry & VMM_PAGE_LARGE)) {
+                return entry & PTE_PHYS_ADDR_MASK;
+            }
+
+            phys_t table = split_large_page(pml_entry, entry, large_page_size);
+            if (table != 0) {
+                return table;
+            }
+            continue;
+        }
+
+        if (!alloc) {
+            return 0;
+        }
+
+        if (!get_table(pml)) {
+            return 0;
+        }
+
+        // the requested flags will be set only for the pml1 entry,
+        // allowing pages with different permissions at the last level
+        // all other pml entries are granted all permissions (write, user, execute)
+        phys_t next_pml = alloc_page_table();
+        pml_entry_t new_entry = (pml_entry_t) next_pml | VMM_PAGE_PRESENT | VMM_PAGE_WRITE | VMM_PAGE_USER;
+        if (__atomic_compare_exchange_n(pml_entry, &entry, new_entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return next_pml;
+        }
+
+        // another CPU installed a table first, which counts for itself; should that one be gone again
+        // already, `pml` is left empty but alive, and freed after the next unmapping in it
+        pmm_free(next_pml);
+        __atomic_fetch_sub(&page_table_count, 1, __ATOMIC_RELAXED);
+        put_table(pml, false);
+    }
+}
+
+// frees a page table and all tables below it, once unlinked; `level` is 1 for a pml1
+static void free_page_table(phys_t table, uint8_t level) {
+    __atomic_fetch_add(&walk_generation, 1, __ATOMIC_RELEASE);
+
+    if (level > 1) {
+        pml_entry_t *table_hhdm = (pml_entry_t *) (table + hhdm_offset);
+        for (uint16_t i = 0; i < 512; i++) {
+            if ((table_hhdm[i] & VMM_PAGE_PRESENT) && !(table_hhdm[i] & VMM_PAGE_LARGE)) {
+                free_page_table(table_hhdm[i] & PTE_PHYS_ADDR_MASK, level - 1);
+            }
+        }
     }
 
-    // the requested flags will be set only for the pml1 entry,
-    // allowing pages with different permissions at the last level
-    // all other pml entries are granted all permissions (write, user, execute)
-    *pml_entry = (pml_entry_t) pmm_alloc(true) | VMM_PAGE_PRESENT | VMM_PAGE_WRITE | VMM_PAGE_USER;
-    return *pml_entry & PTE_PHYS_ADDR_MASK;
+    pmm_free(table);
+    __atomic_fetch_sub(&page_table_count, 1, __ATOMIC_RELAXED);
 }
 
-static inline pml_entry_t *get_pml1_entry(phys_t pagemap, uintptr_t virt) {
-    uint16_t pml4_index = (virt >> 39) & 0x1ff;
-    uint16_t pml3_index = (virt >> 30) & 0x1ff;
-    uint16_t pml2_index = (virt >> 21) & 0x1ff;
-    uint16_t pml1_index = (virt >> 12) & 0x1ff;
+// installs a large page into `pml_entry`, which sits at `level`
+static void map_large_page(phys_t pagemap, uintptr_t virt, pml_entry_t *pml_entry, uint8_t level, phys_t phys, uint64_t flags) {
+    uint64_t pat = flags & VMM_PAGE_PAT ? VMM_PAGE_LARGE_PAT : 0;
+    pml_entry_t old_entry = __atomic_exchange_n(pml_entry, phys | VMM_PAGE_PRESENT | VMM_PAGE_LARGE | pat | leaf_flags(virt, flags & ~VMM_PAGE_PAT), __ATOMIC_ACQ_REL);
 
-    phys_t pml4 = pagemap;
-    phys_t pml3 = get_next_pml(pml4, pml4_index);
-    phys_t pml2 = get_next_pml(pml3, pml3_index);
-    phys_t pml1 = get_next_pml(pml2, pml2_index);
+    if (!(old_entry & VMM_PAGE_PRESENT)) {
+        count_entry(pml_entry);
+        return;
+    }
 
-    pml_entry_t *pml1_hhdm = (pml_entry_t *) (pml1 + hhdm_offset);
-    pml_entry_t *pml1_entry = &pml1_hhdm[pml1_index];
-    return pml1_entry;
+    // whatever was mapped here before may be cached anywhere in the range
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+    tlb_batch_add(&batch, virt, level == 3 ? VMM_PAGE_SIZE_1G / PAGE_SIZE : VMM_PAGE_SIZE_2M / PAGE_SIZE);
+    tlb_batch_flush(&batch);
+
+    if (!(old_entry & VMM_PAGE_LARGE)) {
+        free_page_table(old_entry & PTE_PHYS_ADDR_MASK, level - 1);
+    }
 }
 
-static inline void invlpg_if_needed(phys_t pagemap, uintptr_t virt) {
-    phys_t curr_pagemap = rd_cr3();
-    if (pagemap == curr_pagemap) {
-        invlpg(virt);
+// walks to the table at `level` that maps `virt`, allocating the missing ones
+// must be called with interrupts disabled
+static phys_t walk_alloc(phys_t pagemap, uintptr_t virt, uint8_t level) {
+    for (;;) {
+        phys_t table = pagemap;
+        for (uint8_t i = 4; i > level && table != 0; i--) {
+            table = get_next_pml(table, get_pml_index(virt, i), i == 4 ? 0 : (i == 3 ? VMM_PAGE_SIZE_1G : VMM_PAGE_SIZE_2M), true);
+        }
+
+        if (table != 0) {
+            return table;
+        }
     }
 }
 
+void vmm_cursor_init(struct vmm_cursor_t *cursor, phys_t pagemap, uintptr_t virt) {
+    cursor->pagemap = pagemap;
+    cursor->virt = virt;
+    cursor->pml3 = 0;
+    cursor->pml2 = 0;
+    cursor->pml1 = 0;
+    cursor->generation = __atomic_load_n(&walk_generation, __ATOMIC_ACQUIRE);
+    tlb_batch_init(&cursor->batch, pagemap);
+}
+
+// walks down only from the lowest table that the cursor moved out of
+// returns NULL if a table is missing and `alloc` is not set
+// must be called with interrupts disabled
+static pml_entry_t *cursor_get_pml1_entry(struct vmm_cursor_t *cursor, bool alloc) {
+    uintptr_t virt = cursor->virt;
+
+    // any of the tables walked to before may have been unlinked since
+    uint64_t generation = __atomic_load_n(&walk_generation, __ATOMIC_ACQUIRE);
+    if (cursor->generation != generation) {
+        cursor->pml3 = 0;
+        cursor->pml2 = 0;
+        cursor->pml1 = 0;
+        cursor->generation = generation;
+    }
+
+    while (cursor->pml1 == 0 || virt % VMM_PAGE_SIZE_2M == 0) {
+        if (cursor->pml2 == 0 || virt % VMM_PAGE_SIZE_1G == 0) {
+            if (cursor->pml3 == 0 || virt % (512 * VMM_PAGE_SIZE_1G) == 0) {
+                cursor->pml3 = get_next_pml(cursor->pagemap, get_pml_index(virt, 4), 0, alloc);
+            }
+            cursor->pml2 = cursor->pml3 == 0 ? 0 : get_next_pml(cursor->pml3, get_pml_index(virt, 3), VMM_PAGE_SIZE_1G, alloc);
+        }
+        cursor->pml1 = cursor->pml2 == 0 ? 0 : get_next_pml(cursor->pml2, get_pml_index(virt, 2), VMM_PAGE_SIZE_2M, alloc);
+
+        if (cursor->pml1 != 0 || !alloc) {
+            break;
+        }
+
+        // a table on the way was dead, and is gone by now
+        cursor->pml3 = 0;
+        cursor->pml2 = 0;
+    }
+
+    return cursor->pml1 == 0 ? NULL : get_pml_entry(cursor->pml1, get_pml_index(virt, 1));
+}
+
+// as above, and locks the pml1 holding the entry, unless NULL is returned
+// must be called with interrupts disabled, which stay so until cursor_unlock_pml1
+static pml_entry_t *cursor_lock_pml1_entry(struct vmm_cursor_t *cursor, bool alloc) {
+    for (;;) {
+        pml_entry_t *pml1_entry = cursor_get_pml1_entry(cursor, alloc);
+        if (pml1_entry == NULL || !table_counts_ready) {
+            return pml1_entry;
+        }
+
+        struct page_t *page = pmm_phys_to_page(cursor->pml1);
+        spin_lock(&page->table_lock);
+        if (page->entry_count != TABLE_DEAD) {
+            return pml1_entry;
+        }
+        spin_unlock(&page->table_lock);
+
+        // emptied by another CPU since the walk; it is unlinked by now or about to be
+        cursor->pml3 = 0;
+        cursor->pml2 = 0;
+        cursor->pml1 = 0;
+    }
+}
+
+static inline void cursor_unlock_pml1(struct vmm_cursor_t *cursor) {
+    if (table_counts_ready) {
+        spin_unlock(&pmm_phys_to_page(cursor->pml1)->table_lock);
+    }
+}
+
+// unlinks the dead table at `level` under the cursor, then drops the count of the entry
+// that pointed to it, doing the same for the tables above that this leaves empty
+static void cursor_unlink_table(struct vmm_cursor_t *cursor, uint8_t level) {
+    phys_t *tables[] = { &cursor->pml1, &cursor->pml2, &cursor->pml3, &cursor->pagemap };
+    for (; level < 4; level++) {
+        phys_t table = *tables[level - 1];
+        phys_t parent = *tables[level];
+
+        __atomic_store_n(get_pml_entry(parent, get_pml_index(cursor->virt, level + 1)), 0, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&walk_generation, 1, __ATOMIC_RELEASE);
+        tlb_batch_free_table(&cursor->batch, table);
+        __atomic_fetch_sub(&page_table_count, 1, __ATOMIC_RELAXED);
+        // the cursor walks down again from the table above
+        *tables[level - 1] = 0;
+
+        // pml3 tables of the kernel half are shared by every pagemap, and the pml4 is the pagemap itself
+        bool may_unlink = level + 1 < 4 && (level + 1 < 3 || cursor->virt < VMM_KERNEL_HALF_START);
+        if (!put_table(parent, may_unlink)) {
+            return;
+        }
+    }
+}
+
+void vmm_cursor_map(struct vmm_cursor_t *cursor, phys_t phys, uint64_t flags) {
+    bool old_int_state = interrupts_set(false);
+
+    pml_entry_t *pml1_entry = cursor_lock_pml1_entry(cursor, true);
+    // pages are always mapped with the present flag set
+    pml_entry_t old_entry = __atomic_exchange_n(pml1_entry, phys | VMM_PAGE_PRESENT | leaf_flags(cursor->virt, flags), __ATOMIC_RELEASE);
+
+    // non-present entries are never cached, so only replaced mappings need invalidating
+    if (old_entry & VMM_PAGE_PRESENT) {
+        tlb_batch_add(&cursor->batch, cursor->virt, 1);
+    } else {
+        count_entry(pml1_entry);
+    }
+
+    cursor_unlock_pml1(cursor);
+    interrupts_set(old_int_state);
+    cursor->virt += PAGE_SIZE;
+}
+
+phys_t vmm_cursor_unmap(struct vmm_cursor_t *cursor) {
+    bool old_int_state = interrupts_set(false);
+
+    pml_entry_t *pml1_entry = cursor_lock_pml1_entry(cursor, false);
+
+    phys_t phys = 0;
+    if (pml1_entry != NULL) {
+        bool emptied = false;
+        if (*pml1_entry & VMM_PAGE_PRESENT) {
+            phys = *pml1_entry & PTE_PHYS_ADDR_MASK;
+            __atomic_store_n(pml1_entry, 0, __ATOMIC_RELEASE);
+            // added before any table is freed, see tlb_batch_free_table
+            tlb_batch_add(&cursor->batch, cursor->virt, 1);
+            emptied = put_table(cursor->pml1, true);
+        }
+        cursor_unlock_pml1(cursor);
+
+        if (emptied) {
+            cursor_unlink_table(cursor, 1);
+        }
+    }
+
+    interrupts_set(old_int_state);
+    cursor->virt += PAGE_SIZE;
+    return phys;
+}
+
+void vmm_cursor_finish(struct vmm_cursor_t *cursor) {
+    tlb_batch_flush(&cursor->batch);
+}
+
 void vmm_map_hhdm(phys_t phys) {
+    // usable memory is in the HHDM already, mapped with large pages that should not be split
+    if (vmm_walk_page(kernel_pagemap, phys + hhdm_offset) == phys) {
+        return;
+    }
+
     vmm_map_page(kernel_pagemap, phys + hhdm_offset, phys, VMM_FLAGS_HHDM);
 }
 
+void vmm_map_hhdm_range(phys_t start, phys_t end, uint64_t cache_flags) {
+    kassert(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+
+    struct hhdm_stats_t stats = { 0 };
+    map_hhdm_range(start, end, VMM_FLAGS_HHDM | cache_flags, &stats);
+    wbinvd();
+}
+
 void vmm_map_page(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags) {
-    // pages are always mapped with the present flag set
-    *get_pml1_entry(pagemap, virt) = phys | VMM_PAGE_PRESENT | flags;
-    invlpg_if_needed(pagemap, virt);
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, virt);
+    vmm_cursor_map(&cursor, phys, flags);
+    vmm_cursor_finish(&cursor);
+}
+
+void vmm_map_page_2m(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags) {
+    kassert(virt % VMM_PAGE_SIZE_2M == 0 && phys % VMM_PAGE_SIZE_2M == 0);
+
+    bool old_int_state = interrupts_set(false);
+    phys_t pml2 = walk_alloc(pagemap, virt, 2);
+    map_large_page(pagemap, virt, get_pml_entry(pml2, get_pml_index(virt, 2)), 2, phys, flags);
+    interrupts_set(old_int_state);
+}
+
+void vmm_map_page_1g(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags) {
+    kassert(pages_1g_supported);
+    kassert(virt % VMM_PAGE_SIZE_1G == 0 && phys % VMM_PAGE_SIZE_1G == 0);
+
+    bool old_int_state = interrupts_set(false);
+    phys_t pml3 = walk_alloc(pagemap, virt, 3);
+    map_large_page(pagemap, virt, get_pml_entry(pml3, get_pml_index(virt, 3)), 3, phys, flags);
+    interrupts_set(old_int_state);
+}
+
+void vmm_remap_page(phys_t pagemap, uintptr_t virt, phys_t phys) {
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, virt);
+
+    bool old_int_state = interrupts_set(false);
+    pml_entry_t *pml1_entry = cursor_lock_pml1_entry(&cursor, false);
+    kassert(pml1_entry != NULL && (*pml1_entry & VMM_PAGE_PRESENT));
+    __atomic_store_n(pml1_entry, (*pml1_entry & ~PTE_PHYS_ADDR_MASK) | phys, __ATOMIC_RELEASE);
+    tlb_batch_add(&cursor.batch, virt, 1);
+    cursor_unlock_pml1(&cursor);
+    interrupts_set(old_int_state);
+
+    vmm_cursor_finish(&cursor);
 }
 
 void vmm_map_range_contig(phys_t pagemap, uintptr_t virt_start, phys_t phys_start, uint64_t page_count, uint64_t flags) {
-    uintptr_t length = page_count * PAGE_SIZE;
-    for (uintptr_t i = 0; i < length; i += PAGE_SIZE) {
-        vmm_map_page(pagemap, virt_start + i, phys_start + i, flags);
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, virt_start);
+    for (uint64_t i = 0; i < page_count; i++) {
+        vmm_cursor_map(&cursor, phys_start + i * PAGE_SIZE, flags);
     }
+    vmm_cursor_finish(&cursor);
 }
 
 void vmm_set_hhdm_offset(uintptr_t offset) {
@@ -155,23 +718,211 @@ void vmm_set_hhdm_offset(uintptr_t offset) {
 }
 
 void vmm_unmap_page(phys_t pagemap, uintptr_t virt) {
-    *get_pml1_entry(pagemap, virt) = 0;
-    invlpg_if_needed(pagemap, virt);
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, virt);
+    vmm_cursor_unmap(&cursor);
+    vmm_cursor_finish(&cursor);
 }
 
 void vmm_unmap_range_contig(phys_t pagemap, uintptr_t virt_start, uint64_t page_count) {
-    uintptr_t length = page_count * PAGE_SIZE;
-    for (uintptr_t i = 0; i < length; i += PAGE_SIZE) {
-        vmm_unmap_page(pagemap, virt_start + i);
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, virt_start);
+    for (uint64_t i = 0; i < page_count; i++) {
+        vmm_cursor_unmap(&cursor);
+    }
+    vmm_cursor_finish(&cursor);
+}
+
+void vmm_map_zero_page(phys_t pagemap, uintptr_t virt, uint64_t flags) {
+    uint64_t cow_flags = flags & VMM_PAGE_WRITE ? (flags & ~VMM_PAGE_WRITE) | VMM_PAGE_COW : flags;
+    vmm_map_page(pagemap, virt, zero_page, cow_flags);
+}
+
+bool vmm_copy_on_write(phys_t pagemap, uintptr_t virt, enum pmm_owner owner) {
+    struct vmm_cursor_t cursor;
+    vmm_cursor_init(&cursor, pagemap, align_down(virt, PAGE_SIZE));
+
+    bool old_int_state = interrupts_set(false);
+
+    pml_entry_t *pml1_entry = cursor_lock_pml1_entry(&cursor, false);
+    if (pml1_entry == NULL) {
+        interrupts_set(old_int_state);
+        return false;
+    }
+
+    // a page that is writable already was resolved by another CPU, whose write
+    // this one missed through a stale TLB entry, which the fault dropped
+    pml_entry_t entry = *pml1_entry;
+    bool resolved = (entry & VMM_PAGE_PRESENT) && (entry & (VMM_PAGE_WRITE | VMM_PAGE_COW));
+    if (resolved && (entry & VMM_PAGE_COW)) {
+        phys_t phys = entry & PTE_PHYS_ADDR_MASK;
+        pml_entry_t new_entry = (entry & ~VMM_PAGE_COW) | VMM_PAGE_WRITE;
+
+        // the last mapping of a page takes it over; no other can be added meanwhile,
+        // as cloning needs the space locked, like resolving this fault
+        if (phys == zero_page || __atomic_load_n(&pmm_phys_to_page(phys)->refcount, __ATOMIC_ACQUIRE) != 1) {
+            phys_t copy = pmm_alloc(phys == zero_page);
+            if (phys != zero_page) {
+                memcpy((void *) (copy + hhdm_offset), (void *) (phys + hhdm_offset), PAGE_SIZE);
+            }
+            pmm_set_owner(copy, 1, owner);
+            new_entry = (new_entry & ~PTE_PHYS_ADDR_MASK) | copy;
+
+            // other CPUs may still read the shared page through the read-only mapping
+            tlb_batch_add(&cursor.batch, cursor.virt, 1);
+            if (phys != zero_page) {
+                tlb_batch_free_page(&cursor.batch, phys);
+            }
+        }
+
+        // permissions only grow when the page is taken over, so no TLB entry needs to be invalidated
+        __atomic_store_n(pml1_entry, new_entry, __ATOMIC_RELEASE);
+    }
+
+    cursor_unlock_pml1(&cursor);
+    interrupts_set(old_int_state);
+
+    vmm_cursor_finish(&cursor);
+    return resolved;
+}
+
+// copies the user half entries of `table` at `level` into `clone`, sharing the pages
+// writable ones are made copy-on-write in both, and added to `batch` to be invalidated
+// must be called with interrupts disabled
+static void clone_table(phys_t table, phys_t clone, uint8_t level, uintptr_t virt, struct tlb_batch_t *batch) {
+    pml_entry_t *table_hhdm = (pml_entry_t *) (table + hhdm_offset);
+    pml_entry_t *clone_hhdm = (pml_entry_t *) (clone + hhdm_offset);
+    uint16_t entry_limit = level == 4 ? 256 : 512;
+    uint32_t entry_count = 0;
+
+    for (uint16_t i = 0; i < entry_limit; i++) {
+        pml_entry_t entry = __atomic_load_n(&table_hhdm[i], __ATOMIC_ACQUIRE);
+        if (!(entry & VMM_PAGE_PRESENT)) {
+            continue;
+        }
+
+        uintptr_t entry_virt = virt + ((uint64_t) i << (12 + 9 * (level - 1)));
+        entry_count++;
+
+        if (level > 1) {
+            // the user half is only ever mapped with 4KiB pages
+            kassert(!(entry & VMM_PAGE_LARGE));
+            phys_t next_clone = alloc_page_table();
+            clone_table(entry & PTE_PHYS_ADDR_MASK, next_clone, level - 1, entry_virt, batch);
+            clone_hhdm[i] = (entry & ~PTE_PHYS_ADDR_MASK) | next_clone;
+            continue;
+        }
+
+        phys_t phys = entry & PTE_PHYS_ADDR_MASK;
+        if (entry & VMM_PAGE_WRITE) {
+            entry = (entry & ~VMM_PAGE_WRITE) | VMM_PAGE_COW;
+            __atomic_store_n(&table_hhdm[i], entry, __ATOMIC_RELEASE);
+            tlb_batch_add(batch, entry_virt, 1);
+        }
+        if (phys != zero_page) {
+            pmm_page_get(phys);
+        }
+        clone_hhdm[i] = entry;
+    }
+
+    pmm_phys_to_page(clone)->entry_count += entry_count;
+}
+
+phys_t vmm_clone_pagemap(phys_t pagemap) {
+    kassert(table_counts_ready);
+
+    phys_t clone = vmm_new_pagemap();
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+
+    bool old_int_state = interrupts_set(false);
+    clone_table(pagemap, clone, 4, 0, &batch);
+    interrupts_set(old_int_state);
+
+    // the pages that were writable must not be written to through the TLB anymore
+    tlb_batch_flush(&batch);
+    return clone;
+}
+
+void vmm_free_pagemap(phys_t pagemap) {
+    kassert(pagemap != kernel_pagemap);
+    kassert(!table_counts_ready || pmm_phys_to_page(pagemap)->entry_count == 256);
+
+    // CPUs that loaded the pagemap before may still cache it under a PCID, which the flush makes them give up
+    struct tlb_batch_t batch;
+    tlb_batch_init(&batch, pagemap);
+    tlb_batch_add(&batch, 0, 1);
+    tlb_batch_free_table(&batch, pagemap);
+    __atomic_fetch_sub(&page_table_count, 1, __ATOMIC_RELAXED);
+    tlb_batch_flush(&batch);
+}
+
+static inline phys_t translate_pml1(phys_t pml1, uintptr_t virt) {
+    pml_entry_t pml1_entry = *get_pml_entry(pml1, get_pml_index(virt, 1));
+    return pml1_entry & VMM_PAGE_PRESENT ? (pml1_entry & PTE_PHYS_ADDR_MASK) | (virt & (PAGE_SIZE - 1)) : 0;
+}
+
+// stores the pml1 mapping `virt` in `pml1`, or 0 if there is none, e.g. for a large page
+// must be called with interrupts disabled
+static phys_t walk(phys_t pagemap, uintptr_t virt, phys_t *pml1) {
+    *pml1 = 0;
+
+    phys_t table = pagemap;
+    for (uint8_t level = 4; level > 1; level--) {
+        pml_entry_t pml_entry = *get_pml_entry(table, get_pml_index(virt, level));
+        if (!(pml_entry & VMM_PAGE_PRESENT)) {
+            return 0;
+        }
+
+        // large pages are not split just to be looked up
+        if (pml_entry & VMM_PAGE_LARGE) {
+            uint64_t page_size = level == 3 ? VMM_PAGE_SIZE_1G : VMM_PAGE_SIZE_2M;
+            return (pml_entry & PTE_PHYS_ADDR_MASK & ~(page_size - 1)) | (virt & (page_size - 1));
+        }
+
+        table = pml_entry & PTE_PHYS_ADDR_MASK;
     }
+
+    *pml1 = table;
+    return translate_pml1(table, virt);
 }
 
 phys_t vmm_walk_page(phys_t pagemap, uintptr_t virt) {
-    pml_entry_t pml1_entry = *get_pml1_entry(pagemap, virt);
-    if (pml1_entry & VMM_PAGE_PRESENT) {
-        uint16_t page_offset = virt & 0xfff;
-        return (pml1_entry & PTE_PHYS_ADDR_MASK) | page_offset;
+    bool old_int_state = interrupts_set(false);
+    phys_t pml1;
+    phys_t phys = walk(pagemap, virt, &pml1);
+    interrupts_set(old_int_state);
+    return phys;
+}
+
+phys_t vmm_walk_page_cached(phys_t pagemap, uintptr_t virt) {
+    bool old_int_state = interrupts_set(false);
+
+    struct vmm_walk_cache_t *cache = &get_cpu()->walk_cache;
+    uint64_t generation = __atomic_load_n(&walk_generation, __ATOMIC_ACQUIRE);
+    if (cache->generation != generation) {
+        for (uint8_t i = 0; i < VMM_WALK_CACHE_SIZE; i++) {
+            cache->entries[i].pagemap = 0;
+        }
+        cache->generation = generation;
+    }
+
+    uintptr_t window = align_down(virt, VMM_PAGE_SIZE_2M);
+    uint8_t index = (window / VMM_PAGE_SIZE_2M) % VMM_WALK_CACHE_SIZE;
+
+    phys_t phys;
+    if (cache->entries[index].pagemap == pagemap && cache->entries[index].virt == window) {
+        phys = translate_pml1(cache->entries[index].pml1, virt);
     } else {
-        return 0;
+        phys_t pml1;
+        phys = walk(pagemap, virt, &pml1);
+        if (pml1 != 0) {
+            cache->entries[index].pagemap = pagemap;
+            cache->entries[index].virt = window;
+            cache->entries[index].pml1 = pml1;
+        }
     }
+
+    interrupts_set(old_int_state);
+    return phys;
 }
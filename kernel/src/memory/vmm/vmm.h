@@ -2,19 +2,106 @@
 
 #include "limine.h"
 #include "memory/pmm/pmm.h"
+#include "memory/vmm/tlb.h"
 
 #define VMM_PAGE_WRITE (1 << 1)
 #define VMM_PAGE_USER (1 << 2)
 #define VMM_PAGE_NX (1ull << 63)
 
+// memory types, selected through the PWT and PCD bits, see vmm_init_cpu for the PAT entries
+#define VMM_PAGE_CACHE_WB 0
+#define VMM_PAGE_CACHE_WC (1 << 3)
+#define VMM_PAGE_CACHE_UC_MINUS (1 << 4)
+#define VMM_PAGE_CACHE_UC ((1 << 3) | (1 << 4))
+
+// mappings from here on are shared by every pagemap, and global
+#define VMM_KERNEL_HALF_START 0xffff800000000000
+
+#define VMM_PAGE_SIZE_2M 0x200000ull
+#define VMM_PAGE_SIZE_1G 0x40000000ull
+
+// recent walks down to a pml1 on a CPU, for vmm_walk_page_cached
+#define VMM_WALK_CACHE_SIZE 8
+
+struct vmm_walk_cache_t {
+    // the entries are dropped once page tables were unlinked since this was read
+    uint64_t generation;
+    // indexed by the 2MiB window of the address
+    struct {
+        phys_t pagemap;
+        // start of the 2MiB window the pml1 maps
+        uintptr_t virt;
+        phys_t pml1;
+    } entries[VMM_WALK_CACHE_SIZE];
+};
+
+// maps or unmaps consecutive pages, walking the page tables from the root only once
+// and from the nearest common table when crossing into another one
+// mappings replaced along the way are only invalidated by vmm_cursor_finish, on all CPUs at once
+struct vmm_cursor_t {
+    phys_t pagemap;
+    // address of the next page
+    uintptr_t virt;
+    // tables containing the entries of the next page, 0 if not walked to yet
+    phys_t pml3;
+    phys_t pml2;
+    phys_t pml1;
+    // the tables are walked to again once any table was unlinked since
+    uint64_t generation;
+    // replaced mappings
+    struct tlb_batch_t batch;
+};
+
+void vmm_cursor_init(struct vmm_cursor_t *cursor, phys_t pagemap, uintptr_t virt);
+void vmm_cursor_map(struct vmm_cursor_t *cursor, phys_t phys, uint64_t flags);
+// returns the page that was mapped, 0 if none
+phys_t vmm_cursor_unmap(struct vmm_cursor_t *cursor);
+void vmm_cursor_finish(struct vmm_cursor_t *cursor);
 void vmm_init(struct limine_memmap_response *memmap, struct limine_executable_address_response *executable_addr);
+// programs the PAT and loads the kernel pagemap on this CPU
+void vmm_init_cpu(void);
+// starts keeping count of the entries in use in each page table, so that empty ones can be freed
+// must be called once the page descriptors are set up
+void vmm_init_table_counts(void);
+uint64_t vmm_get_page_table_count(void);
 uintptr_t vmm_get_hhdm_offset(void);
 phys_t vmm_get_kernel_pagemap(void);
+// a pagemap with an empty user half, sharing the kernel half with every other one
+phys_t vmm_new_pagemap(void);
+// a pagemap sharing the pages of the user half of `pagemap` copy-on-write, and the kernel half
+// takes time in proportion to the page tables of the user half, not the memory mapped
+// the user half of `pagemap` must not be updated meanwhile
+phys_t vmm_clone_pagemap(phys_t pagemap);
+// `pagemap` must have an empty user half and be loaded on no CPU
+void vmm_free_pagemap(phys_t pagemap);
 void vmm_load_pagemap(phys_t pagemap);
 void vmm_map_hhdm(phys_t phys);
+// maps [start, end) into the HHDM with the memory type `cache_flags`, replacing whatever is there
+// caches are written back on this CPU only, so other CPUs must not have accessed the range
+void vmm_map_hhdm_range(phys_t start, phys_t end, uint64_t cache_flags);
+// replacing or removing a mapping invalidates it on every CPU that may cache it, see tlb_batch_flush
 void vmm_map_page(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags);
+// both need `virt` and `phys` aligned to the page size; 1GiB pages need CPU support
+// mapping a large page over smaller ones frees the page tables that held them,
+// so the range must not be updated concurrently, unlike with every other function here
+void vmm_map_page_1g(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags);
+void vmm_map_page_2m(phys_t pagemap, uintptr_t virt, phys_t phys, uint64_t flags);
+// points an existing mapping at another page, keeping its flags
+void vmm_remap_page(phys_t pagemap, uintptr_t virt, phys_t phys);
 void vmm_map_range_contig(phys_t pagemap, uintptr_t virt_start, phys_t phys_start, uint64_t page_count, uint64_t flags);
 void vmm_set_hhdm_offset(uintptr_t offset);
+// unmapping frees the page tables left empty, apart from the pml3 tables of the kernel half
 void vmm_unmap_page(phys_t pagemap, uintptr_t virt);
 void vmm_unmap_range_contig(phys_t pagemap, uintptr_t virt_start, uint64_t page_count);
+// a page of zeroes, never freed, for anonymous memory read before it is written to
+phys_t vmm_get_zero_page(void);
+// maps the zero page at `virt`; with VMM_PAGE_WRITE in `flags`, it is copied on the first write
+void vmm_map_zero_page(phys_t pagemap, uintptr_t virt, uint64_t flags);
+// resolves a write to the copy-on-write page at `virt`, taking the page over if this is its last mapping
+// and copying it otherwise, the copy tagged with `owner`; returns false if the page is not copy-on-write
+// the mapping must not be changed meanwhile, which locking its space takes care of
+bool vmm_copy_on_write(phys_t pagemap, uintptr_t virt, enum pmm_owner owner);
+// translates `virt`, returning 0 if it is not mapped; page tables are only read, never allocated
 phys_t vmm_walk_page(phys_t pagemap, uintptr_t virt);
+// as above, but going straight to the pml1 when it was walked to recently on this CPU
+phys_t vmm_walk_page_cached(phys_t pagemap, uintptr_t virt);
@@ -5,6 +5,11 @@
 
 #include "arch/x86_64/gdt/tss.h"
 #include "lib/list/dlist.h"
+#include "memory/kmalloc/kmalloc.h"
+#include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
+#include "memory/vmm/tlb.h"
+#include "memory/vmm/vmm.h"
 #include "sched/thread.h"
 
 DLIST_TYPE_SYNCED(thread_queue_t, struct thread_t);
@@ -13,6 +18,7 @@ struct cpu_t {
     uint64_t id;
     uint64_t acpi_id;
     uint64_t lapic_id;
+    uint32_t numa_node;
     uint64_t lapic_calibration_ticks;
     struct tss_t tss;
     uint32_t cpuid_basic_max;
@@ -20,6 +26,18 @@ struct cpu_t {
     struct thread_t *curr_thread;
     struct thread_queue_t dead_queue;
     struct thread_queue_t run_queue;
+    struct pmm_cache_t pmm_cache;
+    struct kmalloc_cache_t kmalloc_cache;
+    // pagemap loaded through vmm_load_pagemap
+    phys_t pagemap;
+    // space loaded through vmm_space_load, which kernel threads keep running on
+    struct vmm_space_t *space;
+    // set by the CPU sending this one a TLB shootdown, until it is carried out
+    bool tlb_shootdown_pending;
+    // pagemap each PCID was handed out to, 0 if none; the next PCID to recycle
+    phys_t pcid_pagemaps[TLB_PCID_COUNT];
+    uint16_t pcid_next;
+    struct vmm_walk_cache_t walk_cache;
 };
 
 bool cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
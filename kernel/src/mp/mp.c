@@ -1,11 +1,17 @@
+#include "acpi/srat.h"
 #include "arch/x86_64/apic/lapic.h"
 #include "arch/x86_64/asm.h"
 #include "arch/x86_64/gdt/gdt.h"
 #include "arch/x86_64/idt/idt.h"
+#include "kassert/kassert.h"
 #include "klog/klog.h"
 #include "kpanic/kpanic.h"
 #include "limine.h"
 #include "memory/kmalloc/kmalloc.h"
+#include "lib/memutil.h"
+#include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
+#include "memory/vmm/tlb.h"
 #include "memory/vmm/vmm.h"
 #include "mp/cpu.h"
 #include "mp/mp.h"
@@ -13,14 +19,23 @@
 
 static struct cpu_t bsp;
 static uint8_t cpu_halt_vector;
+static uint8_t cpu_stop_vector;
 static struct cpu_t **cpus;
 static uint64_t initialized_cpu_count = 1;
 static bool x2apic_enabled;
 
+// the CPU stopping the others, until all of them are running again
+static struct cpu_t *stopping_cpu;
+static bool stop_released;
+static uint64_t stopped_cpu_count;
+
 static inline void init_cpu_data(struct cpu_t *cpu, uint64_t id, uint64_t acpi_id, uint64_t lapic_id) {
     cpu->id = id;
     cpu->acpi_id = acpi_id;
     cpu->lapic_id = lapic_id;
+    cpu->numa_node = srat_get_cpu_node(lapic_id);
+    cpu->pagemap = 0;
+    cpu->tlb_shootdown_pending = false;
 }
 
 static void ap_entry(struct limine_mp_info *cpu_info) {
@@ -29,7 +44,10 @@ static void ap_entry(struct limine_mp_info *cpu_info) {
 
     // the kernel pagemap must be loaded before any code
     // that accesses the CPU struct, since that is on the kernel heap
-    vmm_load_pagemap(vmm_get_kernel_pagemap());
+    vmm_init_cpu();
+    pmm_init_cpu();
+    kmalloc_init_cpu();
+    vmm_space_init_cpu();
     cpuid_init();
     gdt_reload_segments();
     gdt_reload_tss();
@@ -52,6 +70,23 @@ static void halt_cpu(struct int_ctx_t *ctx) {
     while (1) halt();
 }
 
+static void stop_cpu(struct int_ctx_t *ctx) {
+    (void) ctx;
+
+    __atomic_fetch_add(&stopped_cpu_count, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&stop_released, __ATOMIC_SEQ_CST)) {
+        // from CPUs that have not stopped yet
+        tlb_handle_shootdown();
+        pause();
+    }
+
+    // whatever was changed meanwhile may have left stale translations behind
+    tlb_flush_all_local();
+
+    __atomic_fetch_sub(&stopped_cpu_count, 1, __ATOMIC_SEQ_CST);
+    lapic_send_eoi();
+}
+
 struct cpu_t *mp_get_bsp(void) {
     return &bsp;
 }
@@ -72,6 +107,9 @@ void mp_init(struct limine_mp_response *mp) {
     klog_debug("x2APIC supported and enabled? %s", mp->flags & LIMINE_MP_X2APIC ? "yes" : "no");
     cpus = (struct cpu_t **) kmalloc(mp->cpu_count * sizeof(struct cpu_t *));
 
+    // the BSP was initialized before the SRAT was parsed
+    bsp.numa_node = srat_get_cpu_node(bsp.lapic_id);
+
     if (mp->cpu_count == 1) {
         klog_info("No APs to initialize");
         cpus[0] = &bsp;
@@ -88,6 +126,8 @@ void mp_init(struct limine_mp_response *mp) {
             // BSP CPU struct was already initialized 
         } else {
             cpu = (struct cpu_t *) kmalloc(sizeof(struct cpu_t));
+            // commits the heap pages it spans, as the AP accesses it before it can take page faults
+            memset(cpu, 0, sizeof(struct cpu_t));
             init_cpu_data(cpu, i, cpu_info->processor_id, cpu_info->lapic_id);
         }
 
@@ -107,6 +147,8 @@ void mp_init(struct limine_mp_response *mp) {
 
     cpu_halt_vector = interrupts_alloc_vector();
     interrupts_set_handler(cpu_halt_vector, halt_cpu);
+    cpu_stop_vector = interrupts_alloc_vector();
+    interrupts_set_handler(cpu_stop_vector, stop_cpu);
 
     klog_info("MP initialized %llu %s", initialized_cpu_count, initialized_cpu_count > 1 ? "CPUs" : "CPU");
 }
@@ -128,6 +170,44 @@ void mp_init_early(struct limine_mp_response *mp) {
     kpanic("Could not find BSP");
 }
 
+bool mp_stop_other_cpus(void) {
+    kassert(!interrupts_state());
+
+    struct cpu_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&stopping_cpu, &expected, get_cpu(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+
+    uint64_t cpu_count = mp_get_cpu_count();
+    if (cpu_count > 1) {
+        lapic_ipi_all_no_self(cpu_stop_vector);
+        while (__atomic_load_n(&stopped_cpu_count, __ATOMIC_SEQ_CST) != cpu_count - 1) {
+            // a CPU yet to stop may be waiting for this one to carry out its shootdown
+            tlb_handle_shootdown();
+            pause();
+        }
+    }
+
+    return true;
+}
+
+void mp_resume_other_cpus(void) {
+    kassert(mp_other_cpus_stopped());
+
+    // the next stop may only begin once every CPU has left the handler
+    __atomic_store_n(&stop_released, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&stopped_cpu_count, __ATOMIC_SEQ_CST) != 0) {
+        pause();
+    }
+    __atomic_store_n(&stop_released, false, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&stopping_cpu, NULL, __ATOMIC_SEQ_CST);
+}
+
+bool mp_other_cpus_stopped(void) {
+    return __atomic_load_n(&stopping_cpu, __ATOMIC_SEQ_CST) == get_cpu();
+}
+
 bool mp_x2apic_enabled(void) {
     return x2apic_enabled;
 }
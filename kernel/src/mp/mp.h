@@ -12,4 +12,12 @@ struct cpu_t **mp_get_cpus(void);
 uint8_t mp_get_halt_vector(void);
 void mp_init(struct limine_mp_response *mp);
 void mp_init_early(struct limine_mp_response *mp);
+// parks every other CPU in an interrupt handler, for changes they must not observe halfway
+// must be called with interrupts disabled and no spinlocks held
+// returns false if another CPU is already stopping the others
+bool mp_stop_other_cpus(void);
+// resumes the stopped CPUs, which flush their TLB before going back to what they were doing
+void mp_resume_other_cpus(void);
+// whether this CPU has stopped the others
+bool mp_other_cpus_stopped(void);
 bool mp_x2apic_enabled(void);
@@ -3,7 +3,7 @@
 #include <stdint.h>
 
 #include "lib/list/dlist.h"
-#include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
 
 struct thread_t;
 
@@ -15,7 +15,7 @@ struct proc_t {
         struct proc_t *next;
     } links;
     char *name;
-    phys_t pagemap;
+    struct vmm_space_t *space;
     pid_t pid;
     DLIST_HEAD_SYNCED(threads, struct thread_t);
 };
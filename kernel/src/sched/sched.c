@@ -10,6 +10,7 @@
 #include "lib/spinlock/spinlock.h"
 #include "lib/strutil.h"
 #include "memory/kmalloc/kmalloc.h"
+#include "memory/vmm/space.h"
 #include "memory/vmm/vmm.h"
 #include "mp/cpu.h"
 #include "mp/mp.h"
@@ -27,7 +28,6 @@ static struct {
     tid_t tid;
 } tid_generator;
 
-static const size_t KTHREAD_STACK_SIZE = 32768;
 static const uint64_t SCHED_TIMESLICE = 30000;
 static uint8_t sched_vec;
 
@@ -110,8 +110,8 @@ static struct cpu_t *pick_cpu(void) {
 static struct thread_t *create_thread(void *(*start)(void *), void *arg) {
     struct thread_t *thread = (struct thread_t *) kmalloc(sizeof(struct thread_t));
 
-    void *kstack = kmalloc(KTHREAD_STACK_SIZE);
-    uintptr_t kstack_bottom = (uintptr_t) kstack + KTHREAD_STACK_SIZE;
+    void *kstack = vmm_alloc_kstack();
+    uintptr_t kstack_bottom = (uintptr_t) kstack + VMM_KSTACK_SIZE;
     uint64_t *sp = (uint64_t *) kstack_bottom;
 
     *(--sp) = (uint64_t) arg;
@@ -135,16 +135,12 @@ static struct thread_t *create_thread(void *(*start)(void *), void *arg) {
     return thread;
 }
 
-struct proc_t *sched_new_proc(const char *name, phys_t pagemap) {
-    if (!pagemap) {
-        kpanic("Creating process page tables is not implemented");
-    }
-
+struct proc_t *sched_new_proc(const char *name, struct vmm_space_t *space) {
     struct proc_t *proc = kmalloc(sizeof(struct proc_t));
     size_t name_strlen = strlen(name);
     proc->name = kmalloc(name_strlen);
     memcpy(proc->name, name, name_strlen);
-    proc->pagemap = pagemap;
+    proc->space = space != NULL ? space : vmm_space_create(vmm_new_pagemap());
     proc->pid = new_pid();
     DLIST_INIT_SYNCED(proc->threads);
 
@@ -156,9 +152,12 @@ struct proc_t *sched_new_proc(const char *name, phys_t pagemap) {
 }
 
 struct thread_t *sched_new_kthread(void *(*start)(void *), void *arg) {
+    return sched_new_kthread_on(pick_cpu(), start, arg);
+}
+
+struct thread_t *sched_new_kthread_on(struct cpu_t *cpu, void *(*start)(void *), void *arg) {
     struct thread_t *thread = create_thread(start, arg);
-    struct cpu_t *picked_cpu = pick_cpu();
-    DLIST_INSERT_SYNCED(picked_cpu->run_queue, thread, links);
+    DLIST_INSERT_SYNCED(cpu->run_queue, thread, links);
     return thread;
 }
 
@@ -178,7 +177,7 @@ void sched_init(void) {
     interrupts_set_handler(sched_vec, sched_int_handler);
 
     DLIST_INIT_SYNCED(procs);
-    proc_kernel = sched_new_proc("kernel", vmm_get_kernel_pagemap());
+    proc_kernel = sched_new_proc("kernel", vmm_get_kernel_space());
 
     klog_info("Scheduler initialized");
 }
@@ -242,6 +241,13 @@ void sched_yield(void) {
 
     cpu->curr_thread = next;
 
+    // kernel threads only use the kernel half, so they run on whatever pagemap is loaded
+    // and switching to one costs no TLB entries
+    struct proc_t *next_proc = next->parent;
+    if (next_proc != proc_kernel && next_proc->space != cpu->space) {
+        vmm_space_load(next_proc->space);
+    }
+
     lapic_timer_one_shot(SCHED_TIMESLICE, sched_vec);
     sched_thread_switch(curr_sp_ptr, next_sp_ptr);
 
@@ -267,7 +273,7 @@ static void *worker_free_dead_threads(void *arg) {
 
             // dead_queue is already locked
             DLIST_DELETE(cpu->dead_queue, thread, links);
-            kfree(thread->kstack);
+            vmm_free_kstack(thread->kstack);
             kfree(thread);
 
             thread = next;
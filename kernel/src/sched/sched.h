@@ -1,12 +1,15 @@
 #pragma once
 
-#include "memory/pmm/pmm.h"
+#include "memory/vmm/space.h"
+#include "mp/cpu.h"
 #include "sched/proc.h"
 #include "sched/thread.h"
 
 void sched_init(void);
 void sched_init_cpu(void);
-struct proc_t *sched_new_proc(const char *name, phys_t pagemap);
+// `space` is NULL for a new address space sharing only the kernel half
+struct proc_t *sched_new_proc(const char *name, struct vmm_space_t *space);
 struct thread_t *sched_new_kthread(void *(*start)(void *), void *arg);
+struct thread_t *sched_new_kthread_on(struct cpu_t *cpu, void *(*start)(void *), void *arg);
 struct thread_t *sched_new_thread(struct proc_t *proc, void *(*start)(void *), void *arg);
 void sched_yield(void);